@@ -0,0 +1,216 @@
+// Measures loopback throughput of the server's RETR and STOR against
+// the transfer chunk size (-xfer-buf, -xfer-buf-max). For each setting
+// a server is started on the given root, and a file is downloaded and
+// uploaded over passive mode, once through sendfile()/splice() and once
+// with OPTS INLINE-HASH ON, which takes the copying path.
+// Build with: cc -O2 -o chunkbench chunkbench.c
+// Run with: ./chunkbench ../server/server /dev/shm/bench 1024
+//
+// Results on a 1-vCPU VM (Linux 6.18, root on tmpfs, 1 GiB per run,
+// best of 3, MiB/s):
+//
+//     min     max    RETR    STOR  RETR-copy  STOR-copy
+//    4096    4096    1588     700        539        383
+//   16384   16384    2327    1205        619        490
+//   65536   65536    2373    1281        698        512
+//  262144  262144    2215    1568        882        567
+// 1048576 1048576    3409    1365        810        659
+// 4194304 4194304    3131    1600        751        675
+//    4096 1048576    2771    1562        737        545
+//   16384 1048576    2535    1365        728        559
+//
+// Runs differ by up to 20% from each other, but small fixed chunks are
+// always well behind: 4 KiB reaches about half of the best throughput,
+// 16 KiB about two thirds. From 256 KiB on, the results stay within
+// the noise. The defaults start at 16 KiB, so that a session held back
+// by its client or a rate limit keeps a small buffer, and grow up to
+// 1 MiB, which reaches the plateau without the memory of 4 MiB chunks.
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define PORT  2190
+
+static const struct { const char *min, *max; } settings[] = {
+  { "4096", "4096" },
+  { "16384", "16384" },
+  { "65536", "65536" },
+  { "262144", "262144" },
+  { "1048576", "1048576" },
+  { "4194304", "4194304" },
+  { "4096", "1048576" },
+  { "16384", "1048576" },
+};
+
+static char buf[1 << 20];
+
+static double now()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static int connect_to(int port)
+{
+  struct sockaddr_in addr = { 0 };
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  int fd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (connect(fd, (struct sockaddr *)&addr, sizeof addr) == -1) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Reads a reply, skipping the lines of a multi-line one,
+// and returns its code
+static int reply(FILE *ctl, char *line, size_t size)
+{
+  do {
+    if (fgets(line, size, ctl) == NULL) {
+      printf("Control connection closed\n");
+      exit(1);
+    }
+  } while (strlen(line) < 4 || line[3] != ' ');
+  return atoi(line);
+}
+
+static int command(FILE *ctl, int fd, const char *cmd)
+{
+  char line[256];
+  dprintf(fd, "%s\r\n", cmd);
+  return reply(ctl, line, sizeof line);
+}
+
+// Opens a passive mode data connection
+static int pasv(FILE *ctl, int fd)
+{
+  char line[256];
+  dprintf(fd, "PASV\r\n");
+  if (reply(ctl, line, sizeof line) != 227) return -1;
+  int p1, p2;
+  char *s = strchr(line, '(');
+  if (s == NULL || sscanf(s, "(%*d,%*d,%*d,%*d,%d,%d)", &p1, &p2) != 2)
+    return -1;
+  return connect_to(p1 * 256 + p2);
+}
+
+// Transfers one file and returns the throughput in MiB/s, 0 on failure
+static double transfer(FILE *ctl, int fd, int upload, long long total)
+{
+  int data = pasv(ctl, fd);
+  if (data == -1) return 0;
+
+  double start = now();
+  dprintf(fd, upload ? "STOR upload.bin\r\n" : "RETR bench.bin\r\n");
+  char line[256];
+  if (reply(ctl, line, sizeof line) != 150) {
+    close(data);
+    return 0;
+  }
+  long long moved = 0;
+  ssize_t n;
+  if (upload) {
+    while (moved < total && (n = write(data, buf, sizeof buf)) > 0)
+      moved += n;
+  } else {
+    while ((n = read(data, buf, sizeof buf)) > 0) moved += n;
+  }
+  close(data);
+  if (reply(ctl, line, sizeof line) != 226 || moved < total) return 0;
+  return moved / (now() - start) / (1 << 20);
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc < 3) {
+    printf("usage: %s <server> <root> [<MiB per run>]\n", argv[0]);
+    return 1;
+  }
+  long long total = (argc >= 4 ? strtoll(argv[3], NULL, 10) : 1024) << 20;
+
+  // The file to download
+  char path[4096];
+  snprintf(path, sizeof path, "%s/bench.bin", argv[2]);
+  int file = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (file == -1) {
+    printf("Cannot create %s\n", path);
+    return 1;
+  }
+  for (size_t i = 0; i < sizeof buf; i++) buf[i] = rand();
+  for (long long left = total; left > 0; left -= sizeof buf)
+    if (write(file, buf, sizeof buf) != sizeof buf) {
+      printf("Cannot write to %s\n", path);
+      return 1;
+    }
+  close(file);
+
+  printf("%7s %7s %7s %7s %10s %10s\n",
+    "min", "max", "RETR", "STOR", "RETR-copy", "STOR-copy");
+  for (int i = 0; i < sizeof settings / sizeof settings[0]; i++) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      int null = open("/dev/null", O_WRONLY);
+      dup2(null, STDOUT_FILENO);
+      dup2(null, STDERR_FILENO);
+      char port[8];
+      snprintf(port, sizeof port, "%d", PORT);
+      execl(argv[1], argv[1], "-port", port, "-root", argv[2],
+        "-xfer-buf", settings[i].min, "-xfer-buf-max", settings[i].max,
+        (char *)NULL);
+      _exit(1);
+    }
+
+    int fd = -1;
+    for (int tries = 0; tries < 50 && fd == -1; tries++) {
+      usleep(100000);
+      fd = connect_to(PORT);
+    }
+    if (fd == -1) {
+      printf("Cannot connect to the server\n");
+      kill(pid, SIGTERM);
+      return 1;
+    }
+    FILE *ctl = fdopen(fd, "r");
+    char line[256];
+    reply(ctl, line, sizeof line);
+    command(ctl, fd, "USER anonymous");
+    command(ctl, fd, "PASS bench@");
+    command(ctl, fd, "TYPE I");
+
+    double best[4] = { 0 };
+    for (int run = 0; run < 3; run++)
+      for (int k = 0; k < 4; k++) {
+        // The copying path is taken when data is digested on the way
+        if (k == 2) command(ctl, fd, "OPTS INLINE-HASH ON");
+        if (k == 0) command(ctl, fd, "OPTS INLINE-HASH OFF");
+        double r = transfer(ctl, fd, k % 2, total);
+        if (r > best[k]) best[k] = r;
+      }
+
+    command(ctl, fd, "QUIT");
+    fclose(ctl);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+
+    printf("%7s %7s %7.0f %7.0f %10.0f %10.0f\n",
+      settings[i].min, settings[i].max, best[0], best[1], best[2], best[3]);
+  }
+
+  unlink(path);
+  snprintf(path, sizeof path, "%s/upload.bin", argv[2]);
+  unlink(path);
+  return 0;
+}
@@ -1,13 +1,36 @@
 #include "client.h"
 
 #include <ctype.h>
+#include <stddef.h>
 #include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 
+// Limit of commands queued during a transfer
+#define CMDQ_MAX  64
+
+struct cmd_queued_s {
+  struct cmd_queued_s *next;
+  const char *arg;
+  int rejected;   // Commands refused while the queue was full after it
+  char verb[];    // Followed by the argument
+};
+
+pool *client_data_pool;
+pool *client_hash_pool;
+xfer_opts client_xfer_opts = {
+  .buf_min = 16 * 1024,
+  .buf_max = 1024 * 1024,
+  .sock_buf = 0,
+  .deflate_level = 6,
+  .idle_timeout = 300,
+};
+const char *client_admin_user = NULL;
+
 client *client_create(int sock_ctl)
 {
   client *c = malloc(sizeof(client));
@@ -22,15 +45,53 @@ client *client_create(int sock_ctl)
   c->xferred_files_num = 0;
 
   c->wd = strdup("/");
+  c->wd_fd = -1;
   c->rnfr = NULL;
   c->rest_offs = 0;
+  c->mode = 'S';
+  c->deflate_level = client_xfer_opts.deflate_level;
+
+  c->resume_at = 0;
+  c->rct_next = NULL;
+  c->rct = NULL;
+  c->rct_idle_prev = c->rct_idle_next = NULL;
+  c->rct_idle_at = 0;
+
+  c->cmdq_head = NULL;
+  c->cmdq_tail = &c->cmdq_head;
+  c->cmdq_len = 0;
 
   pthread_mutex_init(&c->mutex_ctl, NULL);
+  reply_init(&c->out_ctl);
+  c->out_hold = false;
 
   pthread_mutex_init(&c->mutex_dat, NULL);
   pthread_cond_init(&c->cond_dat, NULL);
   c->thr_dat_running = false;
+  c->thr_dat_busy = false;
+  c->evfd_dat = -1;
+  c->sock_pasv = -1;
+  c->pasv_at = 0;
+  c->dat_conn = -1;
+  c->dat_idle_at = 0;
+  c->dat_type = DATA_UNDEFINED;
   c->dat_fp = NULL;
+  c->dat_ls = NULL;
+  c->dat_blob = NULL;
+  c->dat_path = NULL;
+  c->dat_ticket = 0;
+  c->dat_expect[0] = '\0';
+
+  c->hash_algo = DIGEST_SHA256;
+  c->hash_start = 0;
+  c->hash_end = -1;
+  c->hash_job = NULL;
+  c->hash_busy = false;
+  c->hash_cancel = false;
+  c->hash_inline = false;
+  c->hash_expect[0] = '\0';
+
+  shaper_session_init(&c->shaper);
 
   return c;
 }
@@ -38,6 +99,8 @@ client *client_create(int sock_ctl)
 void client_close(client *c)
 {
   client_close_threads(c);
+  client_hash_stop(c);
+  shaper_session_deinit(&c->shaper);
 
   rlb_deinit(&c->buf_ctl);
   shutdown(c->sock_ctl, SHUT_RDWR);
@@ -45,9 +108,19 @@ void client_close(client *c)
 
   if (c->username != NULL) free(c->username);
   free(c->wd);
+  if (c->wd_fd != -1) close(c->wd_fd);
   if (c->rnfr != NULL) free(c->rnfr);
 
+  if (c->evfd_dat != -1) close(c->evfd_dat);
+
+  while (c->cmdq_head != NULL) {
+    struct cmd_queued_s *q = c->cmdq_head;
+    c->cmdq_head = q->next;
+    free(q);
+  }
+
   pthread_mutex_destroy(&c->mutex_ctl);
+  reply_deinit(&c->out_ctl);
   pthread_mutex_destroy(&c->mutex_dat);
   pthread_cond_destroy(&c->cond_dat);
 
@@ -67,27 +140,83 @@ static const char *WELCOME_MSG =
 static const char *GOODBYE_MSG =
   "Goodbye \\(^ ^)/~";
 
-void client_run_loop(client *c)
+void client_greet(client *c)
+{
+  mark(220, WELCOME_MSG);
+}
+
+static void cmdq_push(client *c, const char *verb, const char *arg)
+{
+  // The refusal is answered after the last queued command, keeping the
+  // replies in the order of the commands
+  if (c->cmdq_len == CMDQ_MAX) {
+    ((struct cmd_queued_s *)
+      ((char *)c->cmdq_tail - offsetof(struct cmd_queued_s, next)))
+      ->rejected++;
+    return;
+  }
+
+  size_t verb_len = strlen(verb), arg_len = strlen(arg);
+  struct cmd_queued_s *q =
+    malloc(sizeof(struct cmd_queued_s) + verb_len + arg_len + 2);
+  q->next = NULL;
+  q->rejected = 0;
+  memcpy(q->verb, verb, verb_len + 1);
+  q->arg = q->verb + verb_len + 1;
+  memcpy((char *)q->arg, arg, arg_len + 1);
+
+  *c->cmdq_tail = q;
+  c->cmdq_tail = &q->next;
+  c->cmdq_len++;
+}
+
+// Runs queued commands until one has to wait for a transfer again
+static cmd_result cmdq_run(client *c)
 {
-  send_mark(c->sock_ctl, 220, WELCOME_MSG);
+  while (c->cmdq_head != NULL && c->resume_at == 0) {
+    struct cmd_queued_s *q = c->cmdq_head;
+    cmd_result r = process_command(c, q->verb, q->arg, false);
+    if (r == CMD_RESULT_BUSY) break;
 
-  char cmd[1024];
-  while (1) {
+    c->cmdq_head = q->next;
+    if (c->cmdq_head == NULL) c->cmdq_tail = &c->cmdq_head;
+    c->cmdq_len--;
+    int rejected = q->rejected;
+    free(q);
+    if (r == CMD_RESULT_SHUTDOWN) return r;
+    while (rejected-- > 0)
+      markf(503, "Too many commands queued, the limit is %d. Ignored.",
+        CMDQ_MAX);
+  }
+  return CMD_RESULT_DONE;
+}
+
+static client_status process_lines(client *c)
+{
+  if (cmdq_run(c) == CMD_RESULT_SHUTDOWN) {
+    mark(221, GOODBYE_MSG);
+    return CLIENT_CLOSED;
+  }
+
+  while (c->resume_at == 0) {
     // Read a command
-    ssize_t cmd_len = rlb_read_line(&c->buf_ctl, cmd, sizeof cmd);
-    if (cmd_len < 0) break;
-    if (cmd_len == sizeof cmd) {
-      send_mark(c->sock_ctl, 500,
-        "Command line too long, the limit is 1023 characters.");
+    char *cmd;
+    ssize_t cmd_len = rlb_next_line(&c->buf_ctl, &cmd);
+    if (cmd_len == -1) break;
+    if (cmd_len == -2) {
+      markf(500, "Command line too long, the limit is %d characters.",
+        RLB_LINE_MAX);
       continue;
     }
 
     // Parse the verb and the argument
     const char *verb = cmd, *arg = "";
     char *p = cmd;
-    while ((*p = toupper(*p)) >= 'A' && *p <= 'Z') p++;
+    // Digits may follow the first letter, as in XSHA256
+    while (((*p = toupper(*p)) >= 'A' && *p <= 'Z') ||
+        (p != cmd && *p >= '0' && *p <= '9')) p++;
     if (*p != ' ' && *p != '\0') {
-      send_mark(c->sock_ctl, 500,
+      mark(500,
         "The verb should be terminate the command line, "
         "or be followed by a space.");
       continue;
@@ -97,29 +226,145 @@ void client_run_loop(client *c)
       arg = p + 1;
     }
 
-    if (process_command(c, verb, arg) == CMD_RESULT_SHUTDOWN)
-      break;
+    // Commands are kept in order behind those already queued
+    cmd_result r = process_command(c, verb, arg, c->cmdq_head != NULL);
+    if (r == CMD_RESULT_BUSY) {
+      cmdq_push(c, verb, arg);
+    } else if (r == CMD_RESULT_SHUTDOWN) {
+      mark(221, GOODBYE_MSG);
+      return CLIENT_CLOSED;
+    }
   }
 
-  send_mark(c->sock_ctl, 221, GOODBYE_MSG);
+  if (c->resume_at != 0) return CLIENT_DEFERRED;
+  if (c->buf_ctl.no_more) {
+    mark(221, GOODBYE_MSG);
+    return CLIENT_CLOSED;
+  }
+  return CLIENT_RUNNING;
+}
+
+// Processes all buffered commands, sending the replies together
+static client_status client_process(client *c)
+{
+  pthread_mutex_lock(&c->mutex_ctl);
+  c->out_hold = true;
+  pthread_mutex_unlock(&c->mutex_ctl);
+
+  client_status status = process_lines(c);
+
+  pthread_mutex_lock(&c->mutex_ctl);
+  c->out_hold = false;
+  bool sent = reply_flush(&c->out_ctl, c->sock_ctl);
+  pthread_mutex_unlock(&c->mutex_ctl);
+  return (status == CLIENT_RUNNING && !sent ? CLIENT_BLOCKED : status);
+}
+
+client_status client_on_readable(client *c)
+{
+  // No more commands are read until the peer takes the replies
+  pthread_mutex_lock(&c->mutex_ctl);
+  bool sent = reply_flush(&c->out_ctl, c->sock_ctl);
+  pthread_mutex_unlock(&c->mutex_ctl);
+  if (!sent) return CLIENT_BLOCKED;
+
+  rlb_fill(&c->buf_ctl);
+  return client_process(c);
+}
+
+client_status client_resume(client *c)
+{
+  c->resume_at = 0;
+  mark(c->resume_code, c->resume_msg);
+  return client_process(c);
+}
+
+void client_defer(client *c, int ms, int code, const char *msg)
+{
+  c->resume_at = monotonic_ms() + ms;
+  c->resume_code = code;
+  c->resume_msg = msg;
 }
 
 bool client_xfer_in_progress(client *c)
 {
-  FILE *f;
-  crit({ f = c->dat_fp; });
-  if (f != NULL) return true;
-  return false;
+  enum dat_type_t t;
+  crit({ t = c->dat_type; });
+  return t != DATA_UNDEFINED;
 }
 
 void client_close_threads(client *c)
 {
-  bool running;
-  crit({ running = c->thr_dat_running; });
+  bool busy;
+  crit({
+    busy = c->thr_dat_busy;
+    c->thr_dat_running = false;
+    c->dat_idle_at = 0;
+    pthread_cond_broadcast(&c->cond_dat);
+  });
+  if (busy) {
+    eventfd_write(c->evfd_dat, 1);
+
+    // If no worker has picked up the job yet, let it clean up here
+    pool_fn job = pool_cancel(client_data_pool, c);
+    if (job != NULL) job(c);
+
+    crit({
+      while (c->thr_dat_busy)
+        pthread_cond_wait(&c->cond_dat, &c->mutex_dat);
+    });
+    eventfd_t v;
+    eventfd_read(c->evfd_dat, &v);
+  }
 
-  if (running) {
-    crit({ c->thr_dat_running = false; });
-    pthread_join(c->thr_dat, NULL);
-    c->state = CLST_READY;
+  // What the session keeps between transfers
+  if (c->dat_conn != -1) {
+    close(c->dat_conn);
+    c->dat_conn = -1;
   }
+  if (c->sock_pasv != -1) {
+    close(c->sock_pasv);
+    c->sock_pasv = -1;
+  }
+  if (c->state >= CLST_PORT) c->state = CLST_READY;
+}
+
+uint64_t client_idle_at(client *c)
+{
+  uint64_t at;
+  crit({ at = c->dat_idle_at; });
+  return at;
+}
+
+void client_idle_expire(client *c, uint64_t now)
+{
+  // PORT or PASV has to be given again
+  uint64_t at = client_idle_at(c);
+  if (at != 0 && at <= now) client_close_threads(c);
+}
+
+bool client_hash_in_progress(client *c)
+{
+  bool busy;
+  crit({ busy = c->hash_busy; });
+  return busy;
+}
+
+void client_hash_stop(client *c)
+{
+  struct hash_job_s *j;
+  crit({
+    j = c->hash_job;
+    c->hash_cancel = true;
+  });
+  if (j == NULL) return;
+
+  // If no worker has picked up the job yet, let it clean up here
+  pool_fn job = pool_cancel(client_hash_pool, j);
+  if (job != NULL) job(j);
+
+  crit({
+    while (c->hash_job != NULL)
+      pthread_cond_wait(&c->cond_dat, &c->mutex_dat);
+  });
 }
@@ -1,7 +1,13 @@
 #ifndef zzftp__client_h
 #define zzftp__client_h
 
+#include "digest.h"
 #include "io_utils.h"
+#include "listing.h"
+#include "lscache.h"
+#include "pool.h"
+#include "reactor.h"
+#include "shaper.h"
 
 #include <pthread.h>
 #include <stdbool.h>
@@ -25,55 +31,163 @@ typedef struct client_s {
   int xferred_files_num;
 
   char *wd;
+  int wd_fd;    // Open working directory, -1 for the root
   char *rnfr;
   size_t rest_offs;
+  char mode;          // Transmission mode: 'S' stream, 'B' block, where the
+                      // connection is kept across transfers, or 'Z' deflate
+  int deflate_level;  // MODE Z compression level
 
   // Port mode: client address and port
   // Passive mode: local address and port
   uint8_t addr[4];
   uint16_t port;
 
-  pthread_mutex_t mutex_ctl;
+  // Deferred reply; the session stops processing commands until it is sent
+  uint64_t resume_at;   // Monotonic time in milliseconds, 0 if not deferred
+  int resume_code;
+  const char *resume_msg;
+  struct client_s *rct_next;  // Link in the reactor's list of deferred sessions
+  struct reactor_s *rct;      // Reactor watching the control connection
+  // Links in the reactor's list of idle data connections, and the time
+  // the session is listed under, 0 if not listed
+  struct client_s *rct_idle_prev, *rct_idle_next;
+  uint64_t rct_idle_at;
+
+  // Commands received during a transfer, run in order once it completes
+  struct cmd_queued_s *cmdq_head, **cmdq_tail;
+  int cmdq_len;
+
+  pthread_mutex_t mutex_ctl;   // Guards the replies
+  reply_buf out_ctl;
+  bool out_hold;    // Replies are held back until the end of a batch
 
   pthread_mutex_t mutex_dat;
   pthread_cond_t cond_dat;
-  pthread_t thr_dat;
-  bool thr_dat_running;
-
-  FILE *dat_fp;
+  bool thr_dat_running;   // Cleared to ask the data job to stop
+  bool thr_dat_busy;      // Data job submitted for a transfer and not
+                          // yet finished
+  int evfd_dat;           // Signalled to wake the data job up
+  int sock_pasv;          // Passive mode: listening socket
+  uint64_t pasv_at;       // Passive mode: time of PASV, 0 once accepted
+  int dat_conn;           // Data connection kept between transfers,
+                          // -1 if none or taken by the data job
+  uint64_t dat_idle_at;   // Time the data connection set up with PORT or
+                          // PASV is closed if no transfer is started,
+                          // 0 for no limit or while a data job runs
+
+  // Pending transfer, handed over to the data job
   enum dat_type_t {
-    DATA_UNDEFINED,
+    DATA_UNDEFINED,   // None
     DATA_SEND_FILE,
     DATA_RECV_FILE,
-    DATA_SEND_PIPE,
+    DATA_SEND_LIST,
+    DATA_SEND_CACHED,
   } dat_type;
+  FILE *dat_fp;         // DATA_SEND_FILE, DATA_RECV_FILE
+  lister *dat_ls;       // DATA_SEND_LIST
+  lsblob *dat_blob;     // DATA_SEND_CACHED
+  char *dat_path;       // File or directory transferred, or NULL
+  uint64_t dat_ticket;  // DATA_SEND_LIST: listing cache ticket
+  char dat_expect[DIGEST_HEX_MAX];  // DATA_RECV_FILE: digest the upload
+  digest_algo dat_expect_algo;      // should have, or ""
+
+  // Checksums for HASH, XCRC and the like, computed by a job
+  digest_algo hash_algo;        // Selected with OPTS HASH
+  off_t hash_start, hash_end;   // Set by RANG, end exclusive or -1
+  struct hash_job_s *hash_job;  // Job submitted and not yet finished
+  bool hash_busy;               // Cleared once the job has replied
+  bool hash_cancel;             // Set to stop the job early
+  bool hash_inline;             // Set by OPTS INLINE-HASH to digest files
+                                // as they are transferred
+  char hash_expect[DIGEST_HEX_MAX];   // Set by XEXP for the next STOR
+  digest_algo hash_expect_algo;
+
+  shaper_session shaper;        // Rate limits of the session and its user
 } client;
 
+// Workers running data connections of all sessions
+extern pool *client_data_pool;
+// Workers computing checksums
+extern pool *client_hash_pool;
+
+// Data connection tuning
+typedef struct xfer_opts_s {
+  size_t buf_min, buf_max;  // Range of the adaptive chunk size,
+                            // equal for a fixed size
+  int sock_buf;             // SO_SNDBUF and SO_RCVBUF, 0 for system default
+  int deflate_level;        // Default MODE Z compression level, 0 to 9
+  int idle_timeout;         // Seconds a data job may wait for a transfer
+                            // before it is ended, 0 for no limit
+} xfer_opts;
+extern xfer_opts client_xfer_opts;
+
+// User allowed to change the limits shared between sessions with SITE RATE,
+// or NULL for nobody
+extern const char *client_admin_user;
+
 client *client_create(int sock_ctl);
 void client_close(client *c);
 
-void client_run_loop(client *c);
+typedef enum client_status_e {
+  CLIENT_RUNNING,   // Waiting for more input
+  CLIENT_BLOCKED,   // Waiting for the peer to take the replies
+  CLIENT_DEFERRED,  // Waiting until `resume_at`
+  CLIENT_CLOSED,    // Session has ended, should be closed
+} client_status;
+
+// Sends the welcome message
+void client_greet(client *c);
+// Sends replies left over, then reads available input from the control
+// connection and processes all complete commands
+client_status client_on_readable(client *c);
+// Sends the deferred reply and continues processing buffered commands
+client_status client_resume(client *c);
+// Defers the reply by `ms` milliseconds
+void client_defer(client *c, int ms, int code, const char *msg);
 
 bool client_xfer_in_progress(client *c);
 void client_close_threads(client *c);
+// Accepts the connection to the passive mode socket ahead of the transfer,
+// to be called by the reactor once the socket is readable
+void client_on_pasv(client *c);
+// Time the session's data connection is closed if left without a transfer,
+// 0 for none
+uint64_t client_idle_at(client *c);
+// Closes the data connection if still without a transfer at `now`
+void client_idle_expire(client *c, uint64_t now);
+bool client_hash_in_progress(client *c);
+// Stops the checksum job, if any, without a reply
+void client_hash_stop(client *c);
 
 typedef enum cmd_result_e {
   CMD_RESULT_DONE,
   CMD_RESULT_SHUTDOWN,
+  CMD_RESULT_BUSY,    // Not run, to be retried once the transfer completes
 } cmd_result;
 
-cmd_result process_command(client *c, const char *verb, const char *arg);
-
-#define mark(_code, _str) do { \
+// Builds the command table, to be called once before processing commands
+void process_init();
+// Runs a command, or returns CMD_RESULT_BUSY for one that has to wait for
+// the transfer in progress, or for earlier commands if `hold` is set
+cmd_result process_command(client *c, const char *verb, const char *arg,
+  bool hold);
+
+// Replies are buffered and sent with one write, or with those to the
+// rest of the batch of commands being processed; what the peer does not
+// take at once is left to the reactor
+#define reply(_call) do { \
   pthread_mutex_lock(&c->mutex_ctl); \
-  send_mark(c->sock_ctl, _code, _str); \
+  _call; \
+  if (!c->out_hold && !reply_flush(&c->out_ctl, c->sock_ctl)) \
+    reactor_wake(c); \
   pthread_mutex_unlock(&c->mutex_ctl); \
 } while (0)
-#define markf(_code, ...) do { \
-  char s[256]; \
-  snprintf(s, sizeof s, __VA_ARGS__); \
-  mark(_code, s); \
-} while (0)
+#define mark(_code, _str) reply(reply_add(&c->out_ctl, _code, _str))
+#define markf(_code, ...) reply(reply_addf(&c->out_ctl, _code, __VA_ARGS__))
+// Sends a reply formatted by the caller, for lines that must not
+// carry the code prefix (RFC 2389 features, RFC 3659 facts)
+#define mark_raw(_str, _len) reply(reply_raw(&c->out_ctl, _str, _len))
 
 #define crit(_block) do { \
   pthread_mutex_lock(&c->mutex_dat); \
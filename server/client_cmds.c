@@ -1,51 +1,58 @@
+#define _GNU_SOURCE   // splice(), pipe2(), ppoll()
+
 #include "client.h"
 #include "auth.h"
+#include "hashcache.h"
 #include "path_utils.h"
+#include "statcache.h"
+#include "stats.h"
 
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <arpa/inet.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
-#ifndef NO_AUTH
-#define auth() do { \
-  if (c->state < CLST_READY) { \
-    mark(530, "Log in first."); \
-    return CMD_RESULT_DONE; \
-  } \
-} while (0)
-#else
-#define auth() do { } while (0)
-#endif
-
-#define data() do { \
-  if (c->state != CLST_PORT && c->state != CLST_PASV) { \
-    mark(425, "Use PORT or PASV first."); \
-    return CMD_RESULT_DONE; \
-  } \
+#define signal_xfer(_block) do { \
+  crit({ _block }); \
+  start_xfer(c); \
 } while (0)
-
 #define signal_file(_ty) \
-  crit({ c->dat_fp = f; c->dat_type = _ty; pthread_cond_signal(&c->cond_dat); })
+  signal_xfer({ c->dat_fp = f; c->dat_type = _ty; })
 
 #define disconnect(_str) do { \
   mark(421, _str " Shutting down connection."); \
   return CMD_RESULT_SHUTDOWN; \
 } while (0)
 
-#define ignore_if_xfer() do if (client_xfer_in_progress(c)) { \
-  mark(503, "Data transfer in progress, ignored."); \
-  return CMD_RESULT_DONE; \
-} while (0)
+// Drops cached metadata and listings after a path has been
+// created, written or removed
+static void path_changed(const char *d)
+{
+  statcache_invalidate(d);
+  lscache_invalidate_parent(d);
+}
+
+// The same after a directory has been removed or renamed,
+// as the paths below it may now refer to other files
+static void tree_changed(const char *d)
+{
+  statcache_invalidate_tree(d);
+  lscache_invalidate_tree(d);
+  lscache_invalidate_parent(d);
+}
 
 // Reference: RFC 954, 5.4, Command-Reply Sequences (pp. 48-52)
 
@@ -63,7 +70,6 @@ static cmd_result handler_SYST(client *c, const char *arg)
 
 static cmd_result handler_TYPE(client *c, const char *arg)
 {
-  ignore_if_xfer();
   if (toupper(arg[0]) == 'I') mark(200, "Type set to I.");
   else if (toupper(arg[0]) == 'A')
     mark(200, "Type set to A.\nNote: no conversion is applied.");
@@ -71,9 +77,67 @@ static cmd_result handler_TYPE(client *c, const char *arg)
   return CMD_RESULT_DONE;
 }
 
+static cmd_result handler_MODE(client *c, const char *arg)
+{
+  char m = toupper(arg[0]);
+  if ((m != 'S' && m != 'B' && m != 'Z') || arg[1] != '\0') {
+    mark(504, "Only stream (S), block (B) and deflate (Z) modes "
+      "are supported.");
+    return CMD_RESULT_DONE;
+  }
+  // Read by the data job as it takes over a transfer
+  crit({ c->mode = m; });
+  markf(200, "Mode set to %c.", m);
+  return CMD_RESULT_DONE;
+}
+
+static cmd_result handler_OPTS(client *c, const char *arg)
+{
+  // Reference: draft-bryan-ftpext-hash, 3.2, OPTS HASH
+  if (strcasecmp(arg, "HASH") == 0) {
+    markf(200, "%s", digest_names[c->hash_algo]);
+    return CMD_RESULT_DONE;
+  }
+  if (strncasecmp(arg, "HASH ", 5) == 0) {
+    digest_algo algo = digest_lookup(arg + 5);
+    if (algo == DIGEST_COUNT) {
+      mark(504, "Unknown algorithm.");
+      return CMD_RESULT_DONE;
+    }
+    c->hash_algo = algo;
+    markf(200, "%s", digest_names[algo]);
+    return CMD_RESULT_DONE;
+  }
+  // Files are digested on the way in and out, for a following HASH
+  if (strncasecmp(arg, "INLINE-HASH ", 12) == 0) {
+    bool on = (strcasecmp(arg + 12, "ON") == 0);
+    if (!on && strcasecmp(arg + 12, "OFF") != 0) {
+      mark(501, "Expected ON or OFF.");
+      return CMD_RESULT_DONE;
+    }
+    crit({ c->hash_inline = on; });
+    markf(200, "Inline hashing %s.", on ? "enabled" : "disabled");
+    return CMD_RESULT_DONE;
+  }
+
+  int level;
+  char extra;
+  if (strncasecmp(arg, "MODE Z LEVEL ", 13) != 0 ||
+      sscanf(arg + 13, "%d%c", &level, &extra) != 1) {
+    mark(501, "Only OPTS HASH, INLINE-HASH and MODE Z LEVEL are supported.");
+    return CMD_RESULT_DONE;
+  }
+  if (level < 0 || level > 9) {
+    mark(501, "The level should be between 0 and 9.");
+    return CMD_RESULT_DONE;
+  }
+  crit({ c->deflate_level = level; });
+  markf(200, "MODE Z level set to %d.", level);
+  return CMD_RESULT_DONE;
+}
+
 static cmd_result handler_USER(client *c, const char *arg)
 {
-  ignore_if_xfer();
   if (c->state >= CLST_READY) {
     mark(503, "Already logged in.");
     return CMD_RESULT_DONE;
@@ -95,7 +159,6 @@ static cmd_result handler_USER(client *c, const char *arg)
 
 static cmd_result handler_PASS(client *c, const char *arg)
 {
-  ignore_if_xfer();
   if (c->state < CLST_WAIT_PASS) {
     mark(503, "Specify your username first.");
     return CMD_RESULT_DONE;
@@ -118,24 +181,72 @@ static cmd_result handler_PASS(client *c, const char *arg)
   } else {
     // Existing user
     if (!user_auth(c->username, arg)) {
-      usleep(1000000);  // Delay before replying
-      mark(530, "Incorrect username/password.");
+      // Delay before replying
+      client_defer(c, 1000, 530, "Incorrect username/password.");
       return CMD_RESULT_DONE;
     }
     // Log in
   }
 
   c->state = CLST_READY;
+  // Anonymous sessions share one user's rate limits
+  shaper_session_login(&c->shaper,
+    strncmp(c->username, "anonymous/", 10) == 0 ? "anonymous" : c->username);
   markf(230, "Logged in. Welcome, %s.", c->username);
   return CMD_RESULT_DONE;
 }
 
 #include "client_xfer_thr.h"
 
+// Hands the pending transfer over to a data job, or to the one still
+// running after the previous transfer of a block mode connection
+static void start_xfer(client *c)
+{
+  bool running;
+  crit({
+    running = c->thr_dat_busy;
+    c->thr_dat_running = c->thr_dat_busy = true;
+    c->dat_idle_at = 0;
+  });
+  if (running) {
+    eventfd_write(c->evfd_dat, 1);
+    return;
+  }
+
+  // Created on first use, reset by client_close_threads()
+  if ((c->evfd_dat != -1 ||
+       (c->evfd_dat = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) != -1) &&
+      pool_submit(client_data_pool, &data_job, c))
+    return;
+
+  // The job releases the transfer at once when asked to stop
+  if (c->evfd_dat == -1) warn("eventfd() failed");
+  crit({ c->thr_dat_running = false; });
+  data_job(c);
+  mark(425, "Cannot open data connection: too many transfers.");
+}
+
+void client_on_pasv(client *c)
+{
+  // A data job accepts the connection itself
+  bool again = false;
+  crit({
+    if (!c->thr_dat_busy && c->sock_pasv != -1 && c->dat_conn == -1) {
+      int fd = accept4(c->sock_pasv, NULL, NULL,
+        SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd != -1) {
+        c->dat_conn = fd;
+        pasv_accepted(c);
+      } else {
+        again = (errno == EAGAIN || errno == EINTR || errno == ECONNABORTED);
+      }
+    }
+  });
+  if (again) reactor_watch_pasv(c);
+}
+
 static cmd_result handler_PORT(client *c, const char *arg)
 {
-  ignore_if_xfer();
-  auth();
   client_close_threads(c);
 
   unsigned x[6];
@@ -149,14 +260,13 @@ static cmd_result handler_PORT(client *c, const char *arg)
     return CMD_RESULT_DONE;
   }
 
-  // Create thread
-  crit({ c->thr_dat_running = true; });
-  if (pthread_create(&c->thr_dat, NULL, &active_data, c) != 0)
-    disconnect("Cannot enter port mode: pthread_create() failed.");
-
   c->state = CLST_PORT;
   for (int i = 0; i < 4; i++) c->addr[i] = x[i];
   c->port = x[4] * 256 + x[5];
+
+  // The connection is made once a transfer is started
+  crit({ c->dat_idle_at = idle_deadline(); });
+
   markf(200, "Will connect to %u.%u.%u.%u:%u\n",
     x[0], x[1], x[2], x[3], c->port);
   return CMD_RESULT_DONE;
@@ -164,26 +274,23 @@ static cmd_result handler_PORT(client *c, const char *arg)
 
 static cmd_result handler_PASV(client *c, const char *arg)
 {
-  ignore_if_xfer();
-  auth();
   client_close_threads(c);
 
   uint8_t addr[6];
   int fd;
   if (ephemeral(c->sock_ctl, addr, &fd) != 0 ||
-      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) == -1 ||
-      listen(fd, 0) == -1)
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) == -1)
+    disconnect("Cannot enter passive mode: cannot start data connection.");
+  // Inherited by the accepted connection
+  sock_buf_setup(fd);
+  if (listen(fd, 0) == -1)
     disconnect("Cannot enter passive mode: cannot start data connection.");
 
   c->state = CLST_PASV;
-
-  // Create thread
-  struct passive_data_arg *thr_arg = malloc(sizeof(struct passive_data_arg));
-  thr_arg->sock_fd = fd;
-  thr_arg->c = c;
-  crit({ c->thr_dat_running = true; });
-  if (pthread_create(&c->thr_dat, NULL, &passive_data, thr_arg) != 0)
-    disconnect("Cannot enter passive mode: pthread_create() failed.");
+  c->sock_pasv = fd;
+  c->pasv_at = monotonic_us();
+  crit({ c->dat_idle_at = idle_deadline(); });
+  reactor_watch_pasv(c);
 
   markf(227, "Entering Passive Mode ("
     "%" PRIu8 ",%" PRIu8 ",%" PRIu8 ",%" PRIu8 ",%" PRIu8 ",%" PRIu8
@@ -191,60 +298,94 @@ static cmd_result handler_PASV(client *c, const char *arg)
   return CMD_RESULT_DONE;
 }
 
+// Resolves the argument into a buffer of PATH_MAX bytes
 #define full_path(_d) do { \
-  _d = path_cat(c->wd, arg); \
-  if (_d == NULL) { \
+  if (path_cat_buf(c->wd, arg, _d, PATH_MAX) == 0) { \
     mark(501, "Argument is not a valid path."); \
     return CMD_RESULT_DONE; \
   } \
 } while (0)
 
-static cmd_result handler_CWD(client *c, const char *arg)
+// Opens a full path from the working directory if it lies beneath,
+// otherwise from the root; either way, it cannot lead out of the root
+static int open_path(client *c, const char *d, int flags, mode_t mode)
 {
-  ignore_if_xfer();
-  auth();
+  size_t n = strlen(c->wd);
+  if (c->wd_fd != -1 && strncmp(d, c->wd, n) == 0 &&
+      (d[n] == '\0' || d[n] == '/')) {
+    int fd = path_openat(c->wd_fd, d[n] == '\0' ? "." : d + n + 1,
+      flags, mode);
+    // Symlinks may lead elsewhere beneath the root
+    if (fd != -1 || errno != EXDEV) return fd;
+  }
+  return path_openat(path_root_fd, d[1] == '\0' ? "." : d + 1, flags, mode);
+}
 
-  char *d; full_path(d);
-  if (!path_exists(d, PATH_REQUIREMENT_DIR)) {
+// Opens the directory containing a full path, for *at() calls on the
+// last component, which is returned through o_name
+static int open_parent(client *c, const char *d, const char **o_name)
+{
+  char p[PATH_MAX];
+  const char *slash = strrchr(d, '/');
+  size_t len = (slash == d ? 1 : slash - d);
+  memcpy(p, d, len);
+  p[len] = '\0';
+  *o_name = slash + 1;
+  return open_path(c, p, O_PATH | O_DIRECTORY | O_CLOEXEC, 0);
+}
+
+static void set_wd(client *c, const char *d, int fd)
+{
+  free(c->wd);
+  c->wd = strdup(d);
+  if (c->wd_fd != -1) close(c->wd_fd);
+  c->wd_fd = fd;
+}
+
+static cmd_result handler_CWD(client *c, const char *arg)
+{
+  char d[PATH_MAX]; full_path(d);
+  int fd = open_path(c, d, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC, 0);
+  if (fd == -1) {
     markf(550, "Directory \"%s\" does not exist.", d);
-    return (free(d), CMD_RESULT_DONE);
+    return CMD_RESULT_DONE;
   }
 
-  free(c->wd);
-  c->wd = d;
+  set_wd(c, d, fd);
   markf(250, "Working directory changed to \"%s\".", d);
   return CMD_RESULT_DONE;
 }
 
 static cmd_result handler_PWD(client *c, const char *arg)
 {
-  ignore_if_xfer();
-  auth();
   markf(257, "Working directory is \"%s\".", c->wd);
   return CMD_RESULT_DONE;
 }
 
 static cmd_result handler_MKD(client *c, const char *arg)
 {
-  ignore_if_xfer();
-  auth();
-
-  char *d; full_path(d);
-  if (mkdir(d + 1, 0755) != 0) {
+  char d[PATH_MAX]; full_path(d);
+  const char *name;
+  int dir_fd = open_parent(c, d, &name);
+  if (dir_fd == -1 || mkdirat(dir_fd, name, 0755) != 0) {
     markf(550, "Cannot create directory \"%s\" (%s).", d, strerror(errno));
-    return (free(d), CMD_RESULT_DONE);
+    if (dir_fd != -1) close(dir_fd);
+    return CMD_RESULT_DONE;
   }
+  close(dir_fd);
 
+  path_changed(d);
   markf(250, "Directory \"%s\" created.", d);
-  return (free(d), CMD_RESULT_DONE);
+  return CMD_RESULT_DONE;
 }
 
 #define mark_dir(_msg, _cmp, ...) do { \
   bool changes_wd = (strcmp(c->wd, _cmp) == 0); \
   if (changes_wd) { \
-    char *d_up = path_cat(d, ".."); \
-    free(c->wd); \
-    c->wd = d_up; \
+    char d_up[PATH_MAX]; \
+    path_cat_buf(d, "..", d_up, sizeof d_up); \
+    set_wd(c, d_up, open_path(c, d_up, \
+      O_PATH | O_DIRECTORY | O_CLOEXEC, 0)); \
     markf(250, _msg " Working directory changed to \"%s\".", \
       __VA_ARGS__, c->wd); \
   } else { \
@@ -254,49 +395,45 @@ static cmd_result handler_MKD(client *c, const char *arg)
 
 static cmd_result handler_RMD(client *c, const char *arg)
 {
-  ignore_if_xfer();
-  auth();
-
-  char *d; full_path(d);
+  char d[PATH_MAX]; full_path(d);
   if (strlen(d) == 1) {
     mark(550, "Cannot remove root directory.");
-    return (free(d), CMD_RESULT_DONE);
+    return CMD_RESULT_DONE;
   }
-  if (rmdir(d + 1) != 0) {
+  const char *name;
+  int dir_fd = open_parent(c, d, &name);
+  if (dir_fd == -1 || unlinkat(dir_fd, name, AT_REMOVEDIR) != 0) {
     markf(550, "Cannot remove directory \"%s\" (%s).", d, strerror(errno));
-    return (free(d), CMD_RESULT_DONE);
+    if (dir_fd != -1) close(dir_fd);
+    return CMD_RESULT_DONE;
   }
+  close(dir_fd);
 
+  tree_changed(d);
   mark_dir("Directory \"%s\" removed.", d, d);
-  return (free(d), CMD_RESULT_DONE);
+  return CMD_RESULT_DONE;
 }
 
 static cmd_result handler_RNFR(client *c, const char *arg)
 {
-  ignore_if_xfer();
-  auth();
-
-  char *d; full_path(d);
+  char d[PATH_MAX]; full_path(d);
   if (strlen(d) == 1) {
     mark(550, "Cannot rename root directory.");
-    return (free(d), CMD_RESULT_DONE);
+    return CMD_RESULT_DONE;
   }
   if (!path_exists(d, PATH_REQUIREMENT_NONE)) {
     markf(550, "Path \"%s\" does not exist.", d);
-    return (free(d), CMD_RESULT_DONE);
+    return CMD_RESULT_DONE;
   }
 
   if (c->rnfr != NULL) free(c->rnfr);
-  c->rnfr = d;
+  c->rnfr = strdup(d);
   markf(250, "Renaming \"%s\".", d);
   return CMD_RESULT_DONE;
 }
 
 static cmd_result handler_RNTO(client *c, const char *arg)
 {
-  ignore_if_xfer();
-  auth();
-
   if (c->rnfr == NULL) {
     mark(503, "Use RNFR first.");
     return CMD_RESULT_DONE;
@@ -305,72 +442,286 @@ static cmd_result handler_RNTO(client *c, const char *arg)
   char *rnfr = c->rnfr;
   c->rnfr = NULL;
 
-  char *d; full_path(d);
+  char d[PATH_MAX];
+  if (path_cat_buf(c->wd, arg, d, sizeof d) == 0) {
+    mark(501, "Argument is not a valid path.");
+    return (free(rnfr), CMD_RESULT_DONE);
+  }
   if (strlen(d) == 1) {
     mark(550, "Cannot rename to root directory.");
-    return (free(rnfr), free(d), CMD_RESULT_DONE);
+    return (free(rnfr), CMD_RESULT_DONE);
   }
-  if (rename(rnfr + 1, d + 1) != 0) {
+  const char *from_name, *to_name;
+  int from_fd = open_parent(c, rnfr, &from_name);
+  int to_fd = (from_fd == -1 ? -1 : open_parent(c, d, &to_name));
+  // A file replaced by the rename is gone; the renamed one keeps its
+  // inode, and so its digests
+  struct stat st;
+  bool replaced = (to_fd != -1 &&
+    fstatat(to_fd, to_name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+    S_ISREG(st.st_mode));
+  if (to_fd == -1 || renameat(from_fd, from_name, to_fd, to_name) != 0) {
     markf(550, "Cannot rename \"%s\" to \"%s\" (%s).",
       rnfr, d, strerror(errno));
-    return (free(rnfr), free(d), CMD_RESULT_DONE);
+    if (from_fd != -1) close(from_fd);
+    if (to_fd != -1) close(to_fd);
+    return (free(rnfr), CMD_RESULT_DONE);
   }
+  close(from_fd);
+  close(to_fd);
+  if (replaced) hashcache_invalidate(&st);
 
+  tree_changed(rnfr);
+  tree_changed(d);
   mark_dir("Renamed \"%s\" to \"%s\".", rnfr, rnfr, d);
-  return (free(rnfr), free(d), CMD_RESULT_DONE);
+  return (free(rnfr), CMD_RESULT_DONE);
 }
 
 static cmd_result handler_DELE(client *c, const char *arg)
 {
-  ignore_if_xfer();
-  auth();
-
-  char *d; full_path(d);
+  char d[PATH_MAX]; full_path(d);
   if (strlen(d) == 1) {
-    mark(550, "Cannot rename root directory.");
-    return (free(d), CMD_RESULT_DONE);
+    mark(550, "Cannot delete root directory.");
+    return CMD_RESULT_DONE;
   }
-  if (!path_exists(d, PATH_REQUIREMENT_REGULAR)) {
+
+  const char *name;
+  struct stat st;
+  int dir_fd = open_parent(c, d, &name);
+  if (dir_fd == -1 ||
+      fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0 ||
+      !S_ISREG(st.st_mode)) {
     markf(550, "File \"%s\" does not exist.", d);
-    return (free(d), CMD_RESULT_DONE);
+    if (dir_fd != -1) close(dir_fd);
+    return CMD_RESULT_DONE;
   }
 
-  if (unlink(d + 1) != 0) {
+  if (unlinkat(dir_fd, name, 0) != 0) {
     markf(550, "Cannot delete \"%s\" (%s).", d, strerror(errno));
-    return (free(d), CMD_RESULT_DONE);
+    close(dir_fd);
+    return CMD_RESULT_DONE;
   }
+  close(dir_fd);
 
+  path_changed(d);
+  hashcache_invalidate(&st);
   markf(250, "Deleted \"%s\".", d);
-  return (free(d), CMD_RESULT_DONE);
+  return CMD_RESULT_DONE;
+}
+
+// Sends the listing of a directory, from the cache when possible
+// Streamed and filtered listings are never cached
+static void send_listing(client *c, const char *dir, char fmt,
+  bool stream, const char *pattern, bool literal)
+{
+  bool cache = (!stream && pattern == NULL);
+  lsblob *b = (cache ? lscache_get(fmt, dir) : NULL);
+  if (b != NULL) {
+    mark(150, "Directory listing is being sent over the data connection.");
+    signal_xfer({ c->dat_blob = b; c->dat_type = DATA_SEND_CACHED; });
+    return;
+  }
+
+  uint64_t ticket = (cache ? lscache_prepare(fmt, dir) : 0);
+  int fd = open_path(c, dir,
+    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC, 0);
+  if (fd == -1) {
+    markf(550, "Cannot list \"%s\" (%s).", dir, strerror(errno));
+    return;
+  }
+  lister *l = lister_open(fd, fmt, stream, pattern, literal);
+
+  mark(150, "Directory listing is being sent over the data connection.");
+  signal_xfer({
+    c->dat_ls = l;
+    c->dat_path = strdup(dir);
+    c->dat_ticket = ticket;
+    c->dat_type = DATA_SEND_LIST;
+  });
+}
+
+// Parses the arguments of LIST and NLST: options as taken by `ls`, of
+// which only -f (unsorted, streamed) has an effect, followed by a path
+// whose last component may be a pattern
+// Replies and returns false on errors, otherwise gives the directory
+// to be listed in a buffer of PATH_MAX bytes and the pattern, if any,
+// which is the name of a single file listed, copied to `o_name` of
+// NAME_MAX + 1 bytes, if `*o_literal` is set
+static bool list_args(client *c, const char *arg, char *o_dir,
+  char *o_name, bool *o_stream, const char **o_pattern, bool *o_literal)
+{
+  *o_stream = false;
+  while (arg[0] == '-') {
+    for (arg++; *arg != '\0' && *arg != ' '; arg++)
+      if (*arg == 'f') *o_stream = true;
+    while (*arg == ' ') arg++;
+  }
+
+  const char *base = strrchr(arg, '/');
+  base = (base == NULL ? arg : base + 1);
+  bool wildcard = (strpbrk(base, "*?[") != NULL);
+
+  char rel[PATH_MAX];
+  size_t rel_len = (wildcard ? base - arg : strlen(arg));
+  if (rel_len >= sizeof rel) {
+    mark(501, "Argument is too long.");
+    return false;
+  }
+  memcpy(rel, arg, rel_len);
+  rel[rel_len] = '\0';
+  if (path_cat_buf(c->wd, rel_len == 0 ? "." : rel, o_dir, PATH_MAX) == 0) {
+    mark(501, "Argument is not a valid path.");
+    return false;
+  }
+
+  if (!path_exists(o_dir, wildcard ? PATH_REQUIREMENT_DIR :
+      PATH_REQUIREMENT_NONE)) {
+    markf(550, "\"%s\" does not exist.", o_dir);
+    return false;
+  }
+
+  *o_pattern = NULL;
+  *o_literal = false;
+  if (wildcard) {
+    *o_pattern = base;
+  } else if (!path_exists(o_dir, PATH_REQUIREMENT_DIR)) {
+    // A single file is listed from its directory by name
+    char *slash = strrchr(o_dir, '/');
+    if (strlen(slash + 1) > NAME_MAX) {
+      mark(501, "Argument is too long.");
+      return false;
+    }
+    strcpy(o_name, slash + 1);
+    *o_pattern = o_name;
+    *o_literal = true;
+    if (slash == o_dir) slash++;
+    *slash = '\0';
+  }
+  return true;
 }
 
 static cmd_result handler_LIST(client *c, const char *arg)
 {
-  ignore_if_xfer();
-  auth();
-  data();
+  char d[PATH_MAX], name[NAME_MAX + 1];
+  bool stream;
+  const char *pattern;
+  bool literal;
+  if (!list_args(c, arg, d, name, &stream, &pattern, &literal))
+    return CMD_RESULT_DONE;
 
-  char *cmd = malloc(10 + strlen(c->wd));
-  strcpy(cmd, "ls -lH ");
-  strcat(cmd, c->wd + 1);
+  send_listing(c, d, LISTER_LONG, stream, pattern, literal);
+  return CMD_RESULT_DONE;
+}
 
-  FILE *f = popen(cmd, "r");
-  if (f == NULL) {
-    mark(550, "Internal error. Cannot list.");
-    return (free(cmd), CMD_RESULT_DONE);
+static cmd_result handler_NLST(client *c, const char *arg)
+{
+  char d[PATH_MAX], name[NAME_MAX + 1];
+  bool stream;
+  const char *pattern;
+  bool literal;
+  if (!list_args(c, arg, d, name, &stream, &pattern, &literal))
+    return CMD_RESULT_DONE;
+
+  send_listing(c, d, LISTER_NAMES, stream, pattern, literal);
+  return CMD_RESULT_DONE;
+}
+
+// Reference: RFC 3659, 4, File Modification Time (MDTM)
+
+static cmd_result handler_MDTM(client *c, const char *arg)
+{
+  char d[PATH_MAX]; full_path(d);
+  struct stat st;
+  if (statcache_lstat(d, &st) != 0) {
+    markf(550, "Cannot stat \"%s\" (%s).", d, strerror(errno));
+    return CMD_RESULT_DONE;
   }
 
-  mark(150, "Directory listing is being sent over the data connection.");
-  signal_file(DATA_SEND_PIPE);
+  struct tm tm;
+  char s[16];
+  gmtime_r(&st.st_mtime, &tm);
+  strftime(s, sizeof s, "%Y%m%d%H%M%S", &tm);
+  mark(213, s);
+  return CMD_RESULT_DONE;
+}
 
-  return (free(cmd), CMD_RESULT_DONE);
+// Reference: RFC 3659, 5, File Size (SIZE)
+
+static cmd_result handler_SIZE(client *c, const char *arg)
+{
+  char d[PATH_MAX]; full_path(d);
+  struct stat st;
+  if (statcache_lstat(d, &st) != 0 || !S_ISREG(st.st_mode)) {
+    markf(550, "File \"%s\" does not exist.", d);
+    return CMD_RESULT_DONE;
+  }
+
+  markf(213, "%lld", (long long)st.st_size);
+  return CMD_RESULT_DONE;
 }
 
-static cmd_result handler_REST(client *c, const char *arg)
+// Reference: RFC 3659, 7, Listings for Machine Processing
+
+static cmd_result handler_MLSD(client *c, const char *arg)
+{
+  // Without an argument, the working directory is meant
+  if (arg[0] == '\0') arg = ".";
+  char d[PATH_MAX]; full_path(d);
+  if (!path_exists(d, PATH_REQUIREMENT_DIR)) {
+    markf(501, "\"%s\" is not a directory.", d);
+    return CMD_RESULT_DONE;
+  }
+
+  send_listing(c, d, LISTER_FACTS, false, NULL, false);
+  return CMD_RESULT_DONE;
+}
+
+static cmd_result handler_MLST(client *c, const char *arg)
+{
+  // Without an argument, the working directory is meant
+  if (arg[0] == '\0') arg = ".";
+  char d[PATH_MAX]; full_path(d);
+  struct stat st;
+  if (statcache_lstat(d, &st) != 0) {
+    markf(550, "Cannot stat \"%s\" (%s).", d, strerror(errno));
+    return CMD_RESULT_DONE;
+  }
+
+  // The fact line starts with a space and carries no code
+  size_t size = 64 + LISTER_FACTS_MAX_LEN + strlen(d) * 2;
+  char *s = malloc(size);
+  size_t len = snprintf(s, size, "250-Listing \"%s\"\r\n ", d);
+  len += lister_facts(&st, d, s + len);
+  len += snprintf(s + len, size - len, "250 End.\r\n");
+  mark_raw(s, len);
+
+  free(s);
+  return CMD_RESULT_DONE;
+}
+
+static cmd_result handler_FEAT(client *c, const char *arg)
 {
-  ignore_if_xfer();
-  auth();
+  char feat[256];
+  size_t len = snprintf(feat, sizeof feat, "211-Features:\r\n HASH ");
+  // The selected algorithm is marked with an asterisk
+  for (int i = 0; i < DIGEST_COUNT; i++)
+    len += snprintf(feat + len, sizeof feat - len, "%s%s%s",
+      i == 0 ? "" : ";", digest_names[i], i == c->hash_algo ? "*" : "");
+  len += snprintf(feat + len, sizeof feat - len,
+    "\r\n"
+    " MDTM\r\n"
+    " MODE Z\r\n"
+    " MLST type*;size*;modify*;unique*;\r\n"
+    " RANG STREAM\r\n"
+    " REST STREAM\r\n"
+    " SIZE\r\n"
+    "211 End.\r\n");
+  mark_raw(feat, len);
+  return CMD_RESULT_DONE;
+}
 
+static cmd_result handler_REST(client *c, const char *arg)
+{
   size_t offs;
   if (sscanf(arg, "%zd", &offs) != 1) {
     mark(501, "Invalid mark. Expected an integer.");
@@ -384,20 +735,22 @@ static cmd_result handler_REST(client *c, const char *arg)
 
 static cmd_result handler_RETR(client *c, const char *arg)
 {
-  ignore_if_xfer();
-  auth();
-  data();
-
-  char *d; full_path(d);
-  if (!path_exists(d, PATH_REQUIREMENT_REGULAR)) {
+  char d[PATH_MAX]; full_path(d);
+  // Non-blocking so that opening a FIFO does not hang; this has
+  // no effect on regular files
+  int fd = open_path(c, d, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC, 0);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
     markf(550, "File \"%s\" does not exist.", d);
-    return (free(d), CMD_RESULT_DONE);
+    if (fd != -1) close(fd);
+    return CMD_RESULT_DONE;
   }
 
-  FILE *f = fopen(d + 1, "r");
+  FILE *f = fdopen(fd, "r");
   if (f == NULL) {
+    close(fd);
     mark(550, "Internal error. Cannot retrieve file.");
-    return (free(d), CMD_RESULT_DONE);
+    return CMD_RESULT_DONE;
   }
 
   fseek(f, c->rest_offs, SEEK_SET);
@@ -406,35 +759,54 @@ static cmd_result handler_RETR(client *c, const char *arg)
   mark(150, "File contents are being sent over the data connection.");
   signal_file(DATA_SEND_FILE);
 
-  return (free(d), CMD_RESULT_DONE);
+  return CMD_RESULT_DONE;
 }
 
 static cmd_result handler_STOR(client *c, const char *arg)
 {
-  ignore_if_xfer();
-  auth();
-  data();
-
-  char *d; full_path(d);
-
-  if (truncate(d + 1, c->rest_offs) != 0) { }
-  c->rest_offs = 0;
-
-  FILE *f = fopen(d + 1, "a");
-  if (f == NULL) {
+  char d[PATH_MAX]; full_path(d);
+  // An expected digest applies to this attempt only
+  char expect[DIGEST_HEX_MAX];
+  strcpy(expect, c->hash_expect);
+  c->hash_expect[0] = '\0';
+
+  // Not opened in append mode, as splice() does not support that
+  int fd = open_path(c, d,
+    O_WRONLY | O_CREAT | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC, 0666);
+  struct stat st;
+  FILE *f = NULL;
+  if (fd == -1 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+      ftruncate(fd, c->rest_offs) != 0 ||
+      lseek(fd, c->rest_offs, SEEK_SET) == -1 ||
+      (f = fdopen(fd, "w")) == NULL) {
+    if (fd != -1) close(fd);
+    c->rest_offs = 0;
     mark(550, "Cannot write to file.");
-    return (free(d), CMD_RESULT_DONE);
+    return CMD_RESULT_DONE;
   }
+  c->rest_offs = 0;
+  path_changed(d);
+  hashcache_invalidate(&st);
 
   mark(150, "Send file contents over the data connection.");
-  signal_file(DATA_RECV_FILE);
+  // The path is kept to invalidate listings once the file is complete
+  signal_xfer({
+    c->dat_fp = f;
+    c->dat_path = strdup(d);
+    strcpy(c->dat_expect, expect);
+    c->dat_expect_algo = c->hash_expect_algo;
+    c->dat_type = DATA_RECV_FILE;
+  });
 
-  return (free(d), CMD_RESULT_DONE);
+  return CMD_RESULT_DONE;
 }
 
 static cmd_result handler_ABOR(client *c, const char *arg)
 {
-  if (client_xfer_in_progress(c)) {
+  if (client_hash_in_progress(c)) {
+    client_hash_stop(c);
+    mark(226, "Checksum aborted.");
+  } else if (client_xfer_in_progress(c)) {
     enum dat_type_t dat_type = c->dat_type;
     client_close_threads(c);
     mark(226, dat_type == DATA_RECV_FILE ?
@@ -446,37 +818,460 @@ static cmd_result handler_ABOR(client *c, const char *arg)
   return CMD_RESULT_DONE;
 }
 
-// Process
+static cmd_result handler_STAT(client *c, const char *arg)
+{
+  if (arg[0] != '\0') {
+    mark(504, "Only server status is supported.");
+    return CMD_RESULT_DONE;
+  }
+
+  char s[4096];
+  size_t len = snprintf(s, sizeof s, "Server status:\n");
+  len += stats_format(s + len, sizeof s - len);
+  snprintf(s + len, sizeof s - len, "End of status.");
+  mark(211, s);
+  return CMD_RESULT_DONE;
+}
+
+// SITE RATE [GLOBAL|USER|SESSION DOWN|UP <bytes/s>]: shows or changes the
+// rate limits; a per-user or per-session limit applies to each user or
+// session apart, and 0 lifts it. Any session may lower its own limit, while
+// GLOBAL and USER are only changed by the user given with -admin-user.
+// Like ABOR, STAT and NOOP it is not queued behind a transfer, so the limit
+// of the transfer running can be changed
+static cmd_result handler_SITE(client *c, const char *arg)
+{
+  static const char *scopes[SHAPER_SCOPES] = { "GLOBAL", "USER", "SESSION" };
+  static const char *dirs[SHAPER_DIRS] = { "DOWN", "UP" };
+
+  if (strcasecmp(arg, "RATE") == 0) {
+    char s[256];
+    size_t len = snprintf(s, sizeof s, "Rate limits in bytes/s:\n");
+    for (int k = 0; k < SHAPER_SCOPES; k++)
+      len += snprintf(s + len, sizeof s - len, "%s DOWN %llu UP %llu\n",
+        scopes[k], (unsigned long long)(k == SHAPER_SESSION ?
+          shaper_session_rate(&c->shaper, SHAPER_DOWN) :
+          shaper_get_rate(k, SHAPER_DOWN)),
+        (unsigned long long)(k == SHAPER_SESSION ?
+          shaper_session_rate(&c->shaper, SHAPER_UP) :
+          shaper_get_rate(k, SHAPER_UP)));
+    snprintf(s + len, sizeof s - len, "End of limits.");
+    mark(200, s);
+    return CMD_RESULT_DONE;
+  }
+
+  char scope[16], dir[16];
+  unsigned long long rate;
+  char extra;
+  if (strncasecmp(arg, "RATE ", 5) != 0 ||
+      sscanf(arg + 5, "%15s %15s %llu%c", scope, dir, &rate, &extra) != 3) {
+    mark(501,
+      "Only SITE RATE [GLOBAL|USER|SESSION DOWN|UP <bytes/s>] is supported.");
+    return CMD_RESULT_DONE;
+  }
+  int k = 0, d = 0;
+  while (k < SHAPER_SCOPES && strcasecmp(scope, scopes[k]) != 0) k++;
+  while (d < SHAPER_DIRS && strcasecmp(dir, dirs[d]) != 0) d++;
+  if (k == SHAPER_SCOPES || d == SHAPER_DIRS) {
+    mark(501, "Expected GLOBAL, USER or SESSION, then DOWN or UP.");
+    return CMD_RESULT_DONE;
+  }
+  // Limits shared with other sessions are left to the administrator,
+  // never an anonymous one
+  if (k != SHAPER_SESSION) {
+    if (client_admin_user == NULL || c->username == NULL ||
+        strncmp(c->username, "anonymous/", 10) == 0 ||
+        strcmp(c->username, client_admin_user) != 0) {
+      mark(550, "Permission denied: only SESSION limits can be changed.");
+      return CMD_RESULT_DONE;
+    }
+    shaper_set_rate(k, d, rate);
+    markf(200, "%s %s rate limit set to %llu bytes/s.", scopes[k], dirs[d],
+      rate);
+    return CMD_RESULT_DONE;
+  }
+
+  // The session's own limit may only lower that of the server
+  shaper_session_set_rate(&c->shaper, d, rate);
+  markf(200, "SESSION %s rate limit set to %llu bytes/s.", dirs[d],
+    (unsigned long long)shaper_session_rate(&c->shaper, d));
+  return CMD_RESULT_DONE;
+}
+
+static cmd_result handler_NOOP(client *c, const char *arg)
+{
+  mark(200, "OK.");
+  return CMD_RESULT_DONE;
+}
+
+// Checksums
+// Reference: draft-bryan-ftpext-hash (HASH), draft-bryan-ftp-range (RANG)
+
+typedef struct hash_job_s {
+  client *c;
+  int fd;
+  struct stat st;     // Of the file when the job was started
+  digest_algo algo;
+  off_t start, end;   // End exclusive
+  bool bare;          // XCRC and the like: the reply is the digest alone
+  char path[];        // HASH: the path as given
+} hash_job;
+
+static void hash_reply(client *c, digest_algo algo, off_t start, off_t end,
+  const char *hex, const char *name)
+{
+  if (name == NULL)
+    markf(250, "%s", hex);
+  else
+    markf(213, "%s %lld-%lld %s %s", digest_names[algo],
+      (long long)start, (long long)(end > start ? end - 1 : end), hex, name);
+}
+
+static void *hash_run(void *arg)
+{
+  hash_job *j = (hash_job *)arg;
+  client *c = j->c;
+
+  char hex[DIGEST_HEX_MAX];
+  int ret = digest_file(j->fd, j->algo, j->start, j->end, &c->hash_cancel, hex);
+
+  // Whole files are cached, unless changed meanwhile
+  struct stat st;
+  if (ret == 0 && j->start == 0 && j->end == j->st.st_size &&
+      fstat(j->fd, &st) == 0 && st.st_size == j->st.st_size &&
+      st.st_mtim.tv_sec == j->st.st_mtim.tv_sec &&
+      st.st_mtim.tv_nsec == j->st.st_mtim.tv_nsec)
+    hashcache_put(&st, j->algo, hex);
+  close(j->fd);
+
+  // Stopped by ABOR or at the end of the session, which reply themselves
+  if (ret == 0)
+    hash_reply(c, j->algo, j->start, j->end, hex, j->bare ? NULL : j->path);
+  else if (ret == -1)
+    mark(451, "Cannot read the file.");
+
+  // Commands queued behind the checksum may run from here on, including
+  // another checksum, so the job is released at the same time. The
+  // session may be released as soon as this is observed.
+  crit({
+    c->hash_busy = false;
+    c->hash_job = NULL;
+    reactor_wake(c);
+    pthread_cond_broadcast(&c->cond_dat);
+  });
+  free(j);
+  return NULL;
+}
+
+// Starts computing the checksum of bytes `start` up to `end` (exclusive,
+// -1 for the end of the file) of a full path
+static void start_hash(client *c, const char *d, const char *name,
+  digest_algo algo, off_t start, off_t end)
+{
+  int fd = open_path(c, d, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC, 0);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    markf(550, "File \"%s\" does not exist.", d);
+    if (fd != -1) close(fd);
+    return;
+  }
+  if (end == -1 || end > st.st_size) end = st.st_size;
+  if (start > end) {
+    mark(501, "The range lies beyond the end of the file.");
+    close(fd);
+    return;
+  }
+
+  char hex[DIGEST_HEX_MAX];
+  if (start == 0 && end == st.st_size && hashcache_get(&st, algo, hex)) {
+    hash_reply(c, algo, start, end, hex, name);
+    close(fd);
+    return;
+  }
+
+  hash_job *j = malloc(sizeof(hash_job) + (name != NULL ? strlen(name) : 0) + 1);
+  j->c = c;
+  j->fd = fd;
+  j->st = st;
+  j->algo = algo;
+  j->start = start;
+  j->end = end;
+  j->bare = (name == NULL);
+  strcpy(j->path, name != NULL ? name : "");
+
+  crit({
+    c->hash_job = j;
+    c->hash_busy = true;
+    c->hash_cancel = false;
+  });
+  if (!pool_submit(client_hash_pool, &hash_run, j)) {
+    crit({
+      c->hash_job = NULL;
+      c->hash_busy = false;
+    });
+    close(fd);
+    free(j);
+    mark(450, "Too many checksums in progress. Try again later.");
+  }
+}
+
+static cmd_result handler_RANG(client *c, const char *arg)
+{
+  long long start, end;
+  char extra;
+  if (sscanf(arg, "%lld %lld%c", &start, &end, &extra) != 2 ||
+      start < 0 || end < 0) {
+    mark(501, "Expected a start and an end point.");
+    return CMD_RESULT_DONE;
+  }
 
-cmd_result process_command(client *c, const char *verb, const char *arg)
-{
-#define def_cmd(_verb) \
-  if (strcmp(verb, #_verb) == 0) return handler_##_verb(c, arg);
-
-  def_cmd(QUIT)
-  def_cmd(SYST)
-  def_cmd(TYPE)
-  def_cmd(USER)
-  def_cmd(PASS)
-  def_cmd(PORT)
-  def_cmd(PASV)
-  def_cmd(CWD)
-  def_cmd(PWD)
-  def_cmd(MKD)
-  def_cmd(RMD)
-  def_cmd(RNFR)
-  def_cmd(RNTO)
-  def_cmd(DELE)
-  def_cmd(LIST)
-  def_cmd(REST)
-  def_cmd(RETR)
-  def_cmd(STOR)
-  def_cmd(ABOR)
-
-#undef def_cmd
-
-  char t[64];
-  snprintf(t, sizeof t, "Unknown command \"%s\"", verb);
-  send_mark(c->sock_ctl, 202, t);
+  // RANG 1 0 resets the range
+  if (start == 1 && end == 0) {
+    c->hash_start = 0;
+    c->hash_end = -1;
+    mark(350, "Restarting at 0. Ending at the end of the file.");
+  } else if (start > end) {
+    mark(501, "The end point should not come before the start point.");
+  } else {
+    c->hash_start = start;
+    c->hash_end = end + 1;
+    markf(350, "Restarting at %lld. Ending at %lld.", start, end);
+  }
+  return CMD_RESULT_DONE;
+}
+
+static cmd_result handler_HASH(client *c, const char *arg)
+{
+  char d[PATH_MAX]; full_path(d);
+  // The range applies to this command only
+  off_t start = c->hash_start, end = c->hash_end;
+  c->hash_start = 0;
+  c->hash_end = -1;
+
+  start_hash(c, d, arg, c->hash_algo, start, end);
+  return CMD_RESULT_DONE;
+}
+
+// XCRC "<path>" [<start> [<end>]], where the path is quoted if it has
+// spaces; the end is exclusive
+static cmd_result x_hash(client *c, const char *arg, digest_algo algo)
+{
+  char p[PATH_MAX];
+  const char *rest;
+  if (arg[0] == '"') {
+    const char *q = strchr(arg + 1, '"');
+    if (q == NULL || q - arg - 1 >= PATH_MAX) {
+      mark(501, "Unterminated quoted path.");
+      return CMD_RESULT_DONE;
+    }
+    memcpy(p, arg + 1, q - arg - 1);
+    p[q - arg - 1] = '\0';
+    rest = q + 1;
+  } else {
+    size_t len = strcspn(arg, " ");
+    if (len >= PATH_MAX) len = PATH_MAX - 1;
+    memcpy(p, arg, len);
+    p[len] = '\0';
+    rest = arg + len;
+  }
+
+  long long pts[2] = { 0, -1 };
+  for (int i = 0; i < 3; i++) {
+    rest += strspn(rest, " ");
+    if (*rest == '\0') break;
+    char *e;
+    if (i == 2 || (pts[i] = strtoll(rest, &e, 10)) < 0 || e == rest) {
+      mark(501, "Expected a path, and optionally a start and an end point.");
+      return CMD_RESULT_DONE;
+    }
+    rest = e;
+  }
+  long long start = pts[0], end = pts[1];
+
+  arg = p;
+  char d[PATH_MAX]; full_path(d);
+  start_hash(c, d, NULL, algo, start, end);
   return CMD_RESULT_DONE;
 }
+
+// XEXP <digest>, in the algorithm selected with OPTS HASH: the digest the
+// data of the next STOR should have, for the upload to be reported failed
+// otherwise; after REST, this covers the data sent from there on
+static cmd_result handler_XEXP(client *c, const char *arg)
+{
+  size_t len = strlen(arg);
+  if (len != digest_hex_len(c->hash_algo) ||
+      strspn(arg, "0123456789abcdefABCDEF") != len) {
+    markf(501, "Expected a %s digest in hexadecimal.",
+      digest_names[c->hash_algo]);
+    return CMD_RESULT_DONE;
+  }
+  strcpy(c->hash_expect, arg);
+  c->hash_expect_algo = c->hash_algo;
+  markf(200, "Expecting %s %s for the next STOR.",
+    digest_names[c->hash_algo], arg);
+  return CMD_RESULT_DONE;
+}
+
+static cmd_result handler_XCRC(client *c, const char *arg)
+{
+  return x_hash(c, arg, DIGEST_CRC32);
+}
+
+static cmd_result handler_XMD5(client *c, const char *arg)
+{
+  return x_hash(c, arg, DIGEST_MD5);
+}
+
+static cmd_result handler_XSHA1(client *c, const char *arg)
+{
+  return x_hash(c, arg, DIGEST_SHA1);
+}
+
+static cmd_result handler_XSHA256(client *c, const char *arg)
+{
+  return x_hash(c, arg, DIGEST_SHA256);
+}
+
+static cmd_result handler_XSHA512(client *c, const char *arg)
+{
+  return x_hash(c, arg, DIGEST_SHA512);
+}
+
+// Process
+
+// Requirements checked before a handler is called
+#define CMD_IDLE  1   // No transfer or checksum in progress,
+                      // queued until it completes
+#define CMD_AUTH  2   // Logged in
+#define CMD_DATA  4   // Data connection set up with PORT or PASV
+
+#define COMMANDS(X) \
+  X(QUIT, CMD_IDLE) \
+  X(SYST, CMD_IDLE) \
+  X(TYPE, CMD_IDLE) \
+  X(MODE, CMD_IDLE) \
+  X(OPTS, CMD_IDLE) \
+  X(USER, CMD_IDLE) \
+  X(PASS, CMD_IDLE) \
+  X(PORT, CMD_IDLE | CMD_AUTH) \
+  X(PASV, CMD_IDLE | CMD_AUTH) \
+  X(CWD,  CMD_IDLE | CMD_AUTH) \
+  X(PWD,  CMD_IDLE | CMD_AUTH) \
+  X(MKD,  CMD_IDLE | CMD_AUTH) \
+  X(RMD,  CMD_IDLE | CMD_AUTH) \
+  X(RNFR, CMD_IDLE | CMD_AUTH) \
+  X(RNTO, CMD_IDLE | CMD_AUTH) \
+  X(DELE, CMD_IDLE | CMD_AUTH) \
+  X(LIST, CMD_IDLE | CMD_AUTH | CMD_DATA) \
+  X(NLST, CMD_IDLE | CMD_AUTH | CMD_DATA) \
+  X(MDTM, CMD_IDLE | CMD_AUTH) \
+  X(SIZE, CMD_IDLE | CMD_AUTH) \
+  X(MLSD, CMD_IDLE | CMD_AUTH | CMD_DATA) \
+  X(MLST, CMD_IDLE | CMD_AUTH) \
+  X(FEAT, CMD_IDLE) \
+  X(REST, CMD_IDLE | CMD_AUTH) \
+  X(RETR, CMD_IDLE | CMD_AUTH | CMD_DATA) \
+  X(STOR, CMD_IDLE | CMD_AUTH | CMD_DATA) \
+  X(ABOR, 0) \
+  X(STAT, CMD_AUTH) \
+  X(NOOP, 0) \
+  X(SITE, CMD_AUTH) \
+  X(RANG, CMD_IDLE | CMD_AUTH) \
+  X(HASH, CMD_IDLE | CMD_AUTH) \
+  X(XEXP, CMD_IDLE | CMD_AUTH) \
+  X(XCRC, CMD_IDLE | CMD_AUTH) \
+  X(XMD5, CMD_IDLE | CMD_AUTH) \
+  X(XSHA1, CMD_IDLE | CMD_AUTH) \
+  X(XSHA256, CMD_IDLE | CMD_AUTH) \
+  X(XSHA512, CMD_IDLE | CMD_AUTH)
+
+// Verbs of up to 8 characters packed into an integer, as the table key
+static inline uint64_t verb_key(const char *verb)
+{
+  uint64_t key = 0;
+  for (int i = 0; verb[i] != '\0'; i++) {
+    if (i == 8) return 0;
+    key |= (uint64_t)(unsigned char)verb[i] << (i * 8);
+  }
+  return key;
+}
+
+// A perfect hash table of commands, indexed by the top bits of the key
+// times a multiplier found at startup to have no collisions
+#define CMD_TABLE_BITS  7
+
+static struct cmd_entry_s {
+  uint64_t key;
+  unsigned flags;
+  cmd_result (*handler)(client *, const char *);
+} cmd_table[1 << CMD_TABLE_BITS];
+static uint64_t cmd_mult;
+
+static inline unsigned cmd_slot(uint64_t key, uint64_t mult)
+{
+  return (key * mult) >> (64 - CMD_TABLE_BITS);
+}
+
+void process_init()
+{
+  const struct cmd_entry_s cmds[] = {
+#define X(_verb, _flags) { verb_key(#_verb), _flags, handler_##_verb },
+    COMMANDS(X)
+#undef X
+  };
+  const int num_cmds = sizeof cmds / sizeof cmds[0];
+
+  // Odd multipliers drawn from a linear congruential sequence, as nearby
+  // ones would scatter short keys alike
+  uint64_t seq = 0x9e3779b97f4a7c15;
+  for (int tries = 0; tries < (1 << 24); tries++) {
+    seq = seq * 6364136223846793005ull + 1442695040888963407ull;
+    uint64_t mult = seq | 1;
+    uint64_t used[(1 << CMD_TABLE_BITS) / 64] = { 0 };
+    int i;
+    for (i = 0; i < num_cmds; i++) {
+      unsigned slot = cmd_slot(cmds[i].key, mult);
+      if (used[slot / 64] & (1ull << (slot % 64))) break;
+      used[slot / 64] |= (1ull << (slot % 64));
+    }
+    if (i < num_cmds) continue;
+
+    cmd_mult = mult;
+    for (i = 0; i < num_cmds; i++)
+      cmd_table[cmd_slot(cmds[i].key, mult)] = cmds[i];
+    return;
+  }
+  panic("No perfect hash for the command table");
+}
+
+cmd_result process_command(client *c, const char *verb, const char *arg,
+  bool hold)
+{
+  uint64_t key = verb_key(verb);
+  const struct cmd_entry_s *e = &cmd_table[cmd_slot(key, cmd_mult)];
+
+  if (key == 0 || e->key != key) {
+    char t[64];
+    snprintf(t, sizeof t, "Unknown command \"%s\"", verb);
+    mark(202, t);
+    return CMD_RESULT_DONE;
+  }
+
+  if ((e->flags & CMD_IDLE) &&
+      (hold || client_xfer_in_progress(c) || client_hash_in_progress(c)))
+    return CMD_RESULT_BUSY;
+#ifndef NO_AUTH
+  if ((e->flags & CMD_AUTH) && c->state < CLST_READY) {
+    mark(530, "Log in first.");
+    return CMD_RESULT_DONE;
+  }
+#endif
+  if ((e->flags & CMD_DATA) &&
+      c->state != CLST_PORT && c->state != CLST_PASV) {
+    mark(425, "Use PORT or PASV first.");
+    return CMD_RESULT_DONE;
+  }
+
+  return e->handler(c, arg);
+}
@@ -1,204 +1,1090 @@
+#include "hashcache.h"
+#include "lscache.h"
+#include "reactor.h"
+#include "sched.h"
+#include "shaper.h"
+#include "stats.h"
+
+#include <math.h>
+#include <poll.h>
+#include <zlib.h>
+
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+// Block mode (RFC 959 MODE B): each block has a header of a descriptor
+// and a 16-bit payload length
+#define BLK_EOF       64    // Last block of the file
+#define BLK_RESTART   16    // Payload is a restart marker, not file data
+#define BLK_MAX       65535
+
+// MODE Z: size of the compressor's output buffer
+#define ZBUF_SIZE     65536
+// Bytes at the start of a file whose entropy decides whether it is
+// compressed, and the entropy in bits per byte above which it is not
+#define ENTROPY_SAMPLE    16384
+#define ENTROPY_MAX       7.5
+
+// Time given to the client to accept an active mode connection, or to
+// connect in passive mode once a transfer is waiting
+#define CONNECT_TIMEOUT_MS  10000
+
+// State of a data connection
+typedef struct xfer_s {
+  int conn_fd;
+  enum dat_type_t dat_type;
+  FILE *fp;
+  lister *ls;
+  lsblob *blob;
+  char *path;               // File or directory being transferred
+  void *buf;
+  size_t buf_cap;           // Allocated size of `buf`
+  const char *out;          // Data read but not yet sent, in `buf`,
+  size_t out_len;           // the lister's buffer or the cached listing
+
+  // Listing rendered so far, stored in the cache once complete
+  uint64_t ticket;          // 0 if not being cached
+  char *acc;
+  size_t acc_len, acc_cap;
+  size_t chunk;             // Bytes to move per call, adapted over time
+  size_t chunk_min, chunk_max;
+  int wake_fd;              // Readable when the data job should look at
+                            // the session again (new file, or stopping)
+  short wait_events;        // Readiness to wait for before the next block
+
+  // Rate limits
+  shaper_session *shaper;
+  shaper_dir shape_dir;
+  size_t quota;             // Bytes that may cross the connection in this call
+  uint64_t delay_us;        // Time to wait for the limits before the next one
+  // Downloads: turn on the link, granted by the scheduler
+  sched_flow flow;
+  bool sched_ready;         // `flow` is set up
+  bool sched_wait;          // Waiting for a quantum before the next block
+
+  bool zero_copy;     // Cleared if the file does not support sendfile/splice
+  bool spliced;       // Data of the current upload has gone through the pipe
+  int pipe_fds[2];    // Relay for splicing uploads, -1 until set up
+  size_t pipe_size;
+
+  // Block mode, where the connection is kept open across transfers
+  bool block;
+  uint8_t hdr[3];           // Header being sent or received
+  size_t hdr_off, hdr_len;  // Header bytes sent (received) and in total
+  size_t blk_left;          // Payload bytes left in the current block
+  uint8_t blk_desc;         // Descriptor of the current block
+  off_t file_left;          // DATA_SEND_FILE: bytes not yet put in a block,
+                            // -1 until found out
+
+  // MODE Z, where data is deflated on the way out and inflated on the way in
+  bool deflate;
+  int z_level;
+  bool z_ready;             // `z` is set up
+  bool z_finish;            // All input has been handed to `z`
+  bool z_end;               // End of the compressed stream reached
+  z_stream z;
+  unsigned char *zbuf;      // Output of `z`
+
+  // Inline digest of the file data as it goes through, for the checksum
+  // cache and to check uploads against the one expected
+  bool hashing;
+  bool dg_ready;            // `dg` is set up
+  digest dg;
+  digest_algo dg_algo;
+  off_t dg_start;           // File offset the digest starts at
+  struct stat dg_st;        // The file when the digest was started
+  char dg_expect[DIGEST_HEX_MAX];   // "" if none
+} xfer;
+
+static inline void blk_reset(xfer *x)
+{
+  x->block = false;
+  x->hdr_off = x->hdr_len = 0;
+  x->blk_left = 0;
+  x->blk_desc = 0;
+  x->file_left = -1;
+}
+
+static inline void z_reset(xfer *x)
+{
+  if (x->z_ready) {
+    if (x->dat_type == DATA_RECV_FILE) inflateEnd(&x->z);
+    else deflateEnd(&x->z);
+    free(x->zbuf);
+  }
+  x->deflate = false;
+  x->z_ready = x->z_finish = x->z_end = false;
+  x->zbuf = NULL;
+}
+
+static inline void dg_reset(xfer *x)
+{
+  if (x->dg_ready) digest_abandon(&x->dg);
+  x->hashing = x->dg_ready = false;
+  x->dg_expect[0] = '\0';
+}
+
+static inline void xfer_init(xfer *x)
+{
+  x->conn_fd = -1;
+  x->dat_type = DATA_UNDEFINED;
+  x->fp = NULL;
+  x->ls = NULL;
+  x->blob = NULL;
+  x->path = NULL;
+  x->ticket = 0;
+  x->acc = NULL;
+  x->acc_len = x->acc_cap = 0;
 #ifndef SLOW_DATA
-  #define BUF_SIZE 1024
+  x->chunk_min = client_xfer_opts.buf_min;
+  x->chunk_max = client_xfer_opts.buf_max;
 #else
-  #define BUF_SIZE 8
+  x->chunk_min = x->chunk_max = 8;
 #endif
+  x->chunk = x->chunk_min;
+  x->buf_cap = x->chunk;
+  x->buf = malloc(x->buf_cap);
+  x->out = NULL;
+  x->out_len = 0;
+  x->wake_fd = -1;
+  x->wait_events = 0;
+  x->shaper = NULL;
+  x->shape_dir = SHAPER_DOWN;
+  x->quota = 0;
+  x->delay_us = 0;
+  x->sched_ready = false;
+  x->sched_wait = false;
 
-#include <poll.h>
+#ifndef SLOW_DATA
+  x->zero_copy = true;
+#else
+  x->zero_copy = false;
+#endif
+  x->spliced = false;
+  x->pipe_fds[0] = x->pipe_fds[1] = -1;
+  x->pipe_size = 0;
 
-#include <sys/socket.h>
+  blk_reset(x);
+  x->z_ready = false;
+  z_reset(x);
+  x->dg_ready = false;
+  dg_reset(x);
+}
+
+// Grows the chunk size after a call has moved a full chunk,
+// and shrinks it when the connection pushes back
+static inline void chunk_adapt(xfer *x, size_t moved)
+{
+  if (moved >= x->chunk) {
+    if (x->chunk < x->chunk_max)
+      x->chunk = (x->chunk * 2 < x->chunk_max ? x->chunk * 2 : x->chunk_max);
+  } else {
+    if (x->chunk > x->chunk_min)
+      x->chunk = (x->chunk / 2 > x->chunk_min ? x->chunk / 2 : x->chunk_min);
+  }
+}
+
+// Takes over the pending transfer from the session, if there is one
+// Must be called with `c->mutex_dat` held
+static inline void xfer_take(client *c, xfer *x)
+{
+  if (x->dat_type != DATA_UNDEFINED) return;
+  x->dat_type = c->dat_type;
+  x->fp = c->dat_fp;
+  x->ls = c->dat_ls;
+  x->blob = c->dat_blob;
+  x->path = c->dat_path;
+  x->ticket = c->dat_ticket;
+  x->block = (c->mode == 'B');
+  x->deflate = (c->mode == 'Z');
+  x->z_level = c->deflate_level;
+  x->hashing = (c->hash_inline || c->dat_expect[0] != '\0') &&
+    (x->dat_type == DATA_SEND_FILE || x->dat_type == DATA_RECV_FILE);
+  x->dg_algo = (c->dat_expect[0] != '\0' ? c->dat_expect_algo : c->hash_algo);
+  strcpy(x->dg_expect, c->dat_expect);
+  c->dat_expect[0] = '\0';
+  if (x->blob != NULL) {
+    x->out = x->blob->data;
+    x->out_len = x->blob->len;
+  }
+}
+
+// Keeps a copy of the listing sent so far for the cache
+static inline void acc_append(xfer *x, const char *data, size_t len)
+{
+  if (x->acc_len + len > x->acc_cap) {
+    x->acc_cap = (x->acc_len + len) * 2;
+    x->acc = realloc(x->acc, x->acc_cap);
+  }
+  memcpy(x->acc + x->acc_len, data, len);
+  x->acc_len += len;
+}
+
+// Makes room for a full chunk in the copy buffer, which must be empty
+static inline void buf_reserve(xfer *x)
+{
+  if (x->buf_cap < x->chunk) {
+    free(x->buf);
+    x->buf_cap = x->chunk;
+    x->buf = malloc(x->buf_cap);
+  }
+}
+
+// Applies the configured socket buffer sizes to a data socket
+static inline void sock_buf_setup(int fd)
+{
+  int size = client_xfer_opts.sock_buf;
+  if (size <= 0) return;
+  if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof size) == -1 ||
+      setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof size) == -1)
+    warn("setsockopt() failed");
+}
+
+// Waits until `fd` is ready for `events` or the data job is woken up,
+// for at most `timeout_ms`, or -1 for no limit
+// Returns 1 if `fd` is ready, 0 if woken up and -1 on timeout
+static inline int xfer_poll(xfer *x, int fd, short events, int timeout_ms)
+{
+  struct pollfd fds[2] = {
+    { .fd = fd, .events = events },
+    { .fd = x->wake_fd, .events = POLLIN },
+  };
+  int n;
+  while ((n = poll(fds, 2, timeout_ms)) == -1) {
+    if (errno != EINTR) {
+      warn("poll() failed");
+      return 0;
+    }
+  }
+  if (n == 0) return -1;
+  if (fds[1].revents & POLLIN) {
+    eventfd_t v;
+    eventfd_read(x->wake_fd, &v);
+    return 0;
+  }
+  return 1;
+}
+// The same without a limit; returns true if `fd` is ready
+static inline bool xfer_wait(xfer *x, int fd, short events)
+{
+  return xfer_poll(x, fd, events, -1) == 1;
+}
+
+// Time a data connection left without a transfer from now on is closed,
+// 0 for no limit
+static inline uint64_t idle_deadline(void)
+{
+  return (client_xfer_opts.idle_timeout == 0 ? 0 :
+    monotonic_ms() + client_xfer_opts.idle_timeout * 1000ULL);
+}
+
+// Tells whether the client has closed a connection kept between transfers
+static inline bool hung_up(int fd)
+{
+  struct pollfd p = { .fd = fd, .events = POLLRDHUP };
+  return poll(&p, 1, 0) == 1 &&
+    (p.revents & (POLLRDHUP | POLLHUP | POLLERR)) != 0;
+}
+
+// Waits out a rate limit, unless the data job is woken up first
+static inline void xfer_delay(xfer *x)
+{
+  struct pollfd fd = { .fd = x->wake_fd, .events = POLLIN };
+  struct timespec ts = {
+    .tv_sec = x->delay_us / 1000000,
+    .tv_nsec = x->delay_us % 1000000 * 1000,
+  };
+  uint64_t start = monotonic_us();
+  if (ppoll(&fd, 1, &ts, NULL) > 0) {
+    eventfd_t v;
+    eventfd_read(x->wake_fd, &v);
+  }
+  stats_add(x->shape_dir == SHAPER_UP ?
+    STAT_THROTTLE_UP_US : STAT_THROTTLE_DOWN_US, monotonic_us() - start);
+}
+
+// Caps a count of bytes to cross the connection to the rate limits
+static inline size_t shape_cap(xfer *x, size_t count)
+{
+  return (count < x->quota ? count : x->quota);
+}
 
-static inline void double_and_limit(int *x, int limit)
+// Charges bytes that have crossed the connection to the rate limits
+static inline void shape_charge(xfer *x, size_t n)
 {
-  int new_x = (*x) * 2;
-  *x = (new_x < limit ? new_x : limit);
+  shaper_charge(x->shaper, x->shape_dir, n);
+  if (x->sched_ready) sched_charge(&x->flow, n);
 }
 
-// 0 - Continue
+// Block mode: starts a block of `len` bytes, sending its header first
+static inline void blk_start(xfer *x, size_t len, uint8_t desc)
+{
+  x->hdr[0] = desc;
+  x->hdr[1] = len >> 8;
+  x->hdr[2] = len & 0xff;
+  x->hdr_off = 0;
+  x->hdr_len = 3;
+  x->blk_left = len;
+  x->blk_desc = desc;
+}
+
+// Block mode: sends the header and, for files, cuts the next block
+// Same return values as process_block(), -1 to go on sending the payload
+static inline int blk_send_next(xfer *x)
+{
+  if (x->hdr_off < x->hdr_len) {
+    // Held back for the payload unless the block is empty
+    ssize_t n = send(x->conn_fd, x->hdr + x->hdr_off, x->hdr_len - x->hdr_off,
+      MSG_NOSIGNAL | (x->blk_left > 0 ? MSG_MORE : 0));
+    if (n == -1) {
+      if (errno == EAGAIN) {
+        x->wait_events = POLLOUT;
+        return 0;
+      }
+      warn("send() failed");
+      return 2;
+    }
+    x->hdr_off += n;
+    return 0;
+  }
+
+  if (x->blk_left > 0) return -1;
+  if (x->blk_desc & BLK_EOF) return 1;
+  if (x->dat_type == DATA_SEND_FILE) {
+    // Blocks are cut from the size at the start, so that the last one
+    // carries the EOF mark
+    if (x->file_left == -1) {
+      struct stat st;
+      if (fstat(fileno(x->fp), &st) != 0) return 2;
+      x->file_left = st.st_size - ftello(x->fp);
+      if (x->file_left < 0) x->file_left = 0;
+    }
+    size_t len = (x->file_left < BLK_MAX ? x->file_left : BLK_MAX);
+    x->file_left -= len;
+    blk_start(x, len, x->file_left == 0 ? BLK_EOF : 0);
+    return 0;
+  }
+  return -1;
+}
+
+// Block mode: receives the next header
+// Same return values as process_block(), -1 to go on receiving the payload
+static inline int blk_recv_next(xfer *x)
+{
+  if (x->blk_left > 0) return -1;
+  if (x->hdr_off == 3) {
+    if (x->blk_desc & BLK_EOF) return 1;
+    x->hdr_off = 0;
+  }
+
+  ssize_t n = read(x->conn_fd, x->hdr + x->hdr_off, 3 - x->hdr_off);
+  if (n == 0) return 3;
+  if (n == -1) {
+    if (errno == EAGAIN) {
+      x->wait_events = POLLIN;
+      return 0;
+    }
+    warn("read() failed");
+    return 3;
+  }
+  x->hdr_off += n;
+  if (x->hdr_off == 3) {
+    x->blk_desc = x->hdr[0];
+    x->blk_left = ((size_t)x->hdr[1] << 8) | x->hdr[2];
+  }
+  return 0;
+}
+
+// Same return values as process_block(), -1 to fall back to copying
+static inline int send_file_zero_copy(xfer *x)
+{
+  size_t count = shape_cap(x, x->chunk);
+  if (x->block && count > x->blk_left) count = x->blk_left;
+
+  // Sends from the current file offset, which is set up by REST
+  ssize_t bytes_sent = sendfile(x->conn_fd, fileno(x->fp), NULL, count);
+  if (bytes_sent > 0) {
+    chunk_adapt(x, bytes_sent);
+    shape_charge(x, bytes_sent);
+    if (x->block) x->blk_left -= bytes_sent;
+    stats_add(STAT_SEND_SENDFILE_BYTES, bytes_sent);
+    return 0;
+  } else if (bytes_sent == 0) {
+    // In block mode, the file has shrunk below the size in the headers
+    return (x->block ? 2 : 1);
+  } else if (errno == EAGAIN) {
+    chunk_adapt(x, 0);
+    x->wait_events = POLLOUT;
+    return 0;
+  } else if (errno == EINVAL || errno == ENOSYS) {
+    return -1;
+  }
+  warn("sendfile() failed");
+  return 2;
+}
+
+// Same return values as process_block(), -1 to fall back to copying
+static inline int recv_file_zero_copy(xfer *x)
+{
+  if (x->pipe_fds[0] == -1) {
+    if (pipe2(x->pipe_fds, O_CLOEXEC) == -1) {
+      warn("pipe2() failed");
+      return -1;
+    }
+    // Enlarge the pipe to move more data per call; this may be
+    // capped by /proc/sys/fs/pipe-max-size
+    fcntl(x->pipe_fds[1], F_SETPIPE_SZ, x->chunk_max);
+    int size = fcntl(x->pipe_fds[1], F_GETPIPE_SZ);
+    x->pipe_size = (size > 0 ? size : 65536);
+  }
+
+  // The pipe is always drained below, so it is empty at this point
+  size_t count = (x->chunk < x->pipe_size ? x->chunk : x->pipe_size);
+  count = shape_cap(x, count);
+  if (x->block && count > x->blk_left) count = x->blk_left;
+  ssize_t bytes_in = splice(x->conn_fd, NULL, x->pipe_fds[1], NULL,
+    count, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  if (bytes_in == 0) {
+    return (x->block ? 3 : 1);
+  } else if (bytes_in == -1) {
+    if (errno == EAGAIN) {
+      chunk_adapt(x, 0);
+      x->wait_events = POLLIN;
+      return 0;
+    }
+    // Not supported for this socket, nothing lost yet
+    if (!x->spliced &&
+        (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP))
+      return -1;
+    warn("splice() failed");
+    return 3;
+  }
+  chunk_adapt(x, bytes_in);
+  shape_charge(x, bytes_in);
+  if (x->block) x->blk_left -= bytes_in;
+  x->spliced = true;
+
+  // Appends to the file at its current offset, which is set up by REST
+  ssize_t left = bytes_in;
+  while (left > 0) {
+    ssize_t bytes_out = splice(x->pipe_fds[0], NULL, fileno(x->fp), NULL,
+      left, SPLICE_F_MOVE);
+    if (bytes_out <= 0) break;
+    left -= bytes_out;
+  }
+  stats_add(STAT_RECV_SPLICE_BYTES, bytes_in - left);
+  if (left == 0) return 0;
+
+  // The data left in the pipe is copied out, and the rest of the file
+  // goes through the buffer if the file does not take splice()
+  int err = errno;
+  warn("splice() failed");
+  buf_reserve(x);
+  while (left > 0) {
+    size_t n = (left < (ssize_t)x->buf_cap ? left : x->buf_cap);
+    if (read_all(x->pipe_fds[0], x->buf, n) != n ||
+        write_all(fileno(x->fp), x->buf, n) != 0)
+      return 2;
+    left -= n;
+    stats_add(STAT_RECV_COPY_BYTES, n);
+  }
+  return (err == EINVAL || err == ENOSYS || err == EOPNOTSUPP ? -1 : 2);
+}
+
+// Tells whether data is likely compressed already, from the entropy of
+// its bytes; cheap next to compressing it
+static inline bool incompressible(const unsigned char *p, size_t len)
+{
+  if (len > ENTROPY_SAMPLE) len = ENTROPY_SAMPLE;
+  uint32_t freq[256] = { 0 };
+  for (size_t i = 0; i < len; i++) freq[p[i]]++;
+
+  double h = 0;
+  for (int i = 0; i < 256; i++) if (freq[i] != 0) {
+    double q = (double)freq[i] / len;
+    h -= q * log2(q);
+  }
+  return h > ENTROPY_MAX;
+}
+
+// MODE Z: sets up the compressor, or the decompressor for uploads
+static inline bool z_setup(xfer *x)
+{
+  memset(&x->z, 0, sizeof x->z);
+  int ret = (x->dat_type == DATA_RECV_FILE ?
+    inflateInit(&x->z) : deflateInit(&x->z, x->z_level));
+  if (ret != Z_OK) {
+    warn("zlib initialisation failed");
+    return false;
+  }
+  x->zbuf = malloc(ZBUF_SIZE);
+  x->z_ready = true;
+
+  // Cached listings are handed over as a whole
+  if (x->dat_type == DATA_SEND_CACHED) {
+    x->z.next_in = (Bytef *)x->out;
+    x->z.avail_in = x->out_len;
+    x->out_len = 0;
+    x->z_finish = true;
+  }
+  return true;
+}
+
+// MODE Z: compresses the file or listing on the way out
+// Same return values as process_block()
+static inline int send_deflate(xfer *x)
+{
+  if (!x->z_ready && !z_setup(x)) return 2;
+
+  if (x->out_len == 0) {
+    if (x->z_end) return 1;
+
+    if (x->z.avail_in == 0 && !x->z_finish) {
+      ssize_t len = 0;
+      if (x->dat_type == DATA_SEND_FILE) {
+        buf_reserve(x);
+        len = fread(x->buf, 1, x->chunk, x->fp);
+        if (len == 0 && ferror(x->fp) != 0) return 2;
+        if (x->hashing) digest_update(&x->dg, x->buf, len);
+        // Archives and media are only wrapped in stored blocks
+        if (x->z.total_in == 0 && x->z_level != 0 &&
+            incompressible(x->buf, len)) {
+          deflateParams(&x->z, 0, Z_DEFAULT_STRATEGY);
+          stats_add(STAT_DEFLATE_SKIPS, 1);
+        }
+        x->z.next_in = x->buf;
+      } else /* if (x->dat_type == DATA_SEND_LIST) */ {
+        const char *p;
+        len = lister_next(x->ls, &p);
+        if (len < 0) return 2;
+        if (len == 0 && x->ticket != 0) {
+          lscache_put(lister_format(x->ls), x->path, x->ticket,
+            x->acc, x->acc_len);
+          x->ticket = 0;
+        }
+        if (x->ticket != 0 && !lscache_fits(x->acc_len + len)) x->ticket = 0;
+        if (x->ticket != 0) acc_append(x, p, len);
+        x->z.next_in = (Bytef *)p;
+      }
+      x->z.avail_in = len;
+      if (len == 0) x->z_finish = true;
+      stats_add(STAT_DEFLATE_IN_BYTES, len);
+    }
+
+    x->z.next_out = x->zbuf;
+    x->z.avail_out = ZBUF_SIZE;
+    int ret = deflate(&x->z, x->z_finish ? Z_FINISH : Z_NO_FLUSH);
+    if (ret == Z_STREAM_ERROR) return 2;
+    if (ret == Z_STREAM_END) x->z_end = true;
+    x->out = (const char *)x->zbuf;
+    x->out_len = ZBUF_SIZE - x->z.avail_out;
+    stats_add(STAT_DEFLATE_OUT_BYTES, x->out_len);
+    // Nothing may come out until more input goes in
+    if (x->out_len == 0) return (x->z_end ? 1 : 0);
+  }
+
+  size_t count = shape_cap(x, x->out_len);
+  ssize_t bytes_sent = write(x->conn_fd, x->out, count);
+  if (bytes_sent == -1) {
+    if (errno == EAGAIN) {
+      chunk_adapt(x, 0);
+      x->wait_events = POLLOUT;
+      return 0;
+    }
+    warn("write() failed");
+    return 2;
+  }
+  if ((size_t)bytes_sent < count) chunk_adapt(x, bytes_sent);
+  shape_charge(x, bytes_sent);
+  x->out += bytes_sent;
+  x->out_len -= bytes_sent;
+  stats_add(STAT_SEND_COPY_BYTES, bytes_sent);
+  return 0;
+}
+
+// MODE Z: decompresses an upload on the way in
+// Same return values as process_block(), with 4 for corrupt data
+static inline int recv_inflate(xfer *x)
+{
+  if (!x->z_ready && !z_setup(x)) return 2;
+
+  if (x->z.avail_in == 0) {
+    buf_reserve(x);
+    ssize_t bytes_read = read(x->conn_fd, x->buf, shape_cap(x, x->chunk));
+    if (bytes_read == -1) {
+      if (errno == EAGAIN) {
+        x->wait_events = POLLIN;
+        return 0;
+      }
+      warn("read() failed");
+      return 3;
+    }
+    // The stream should end before the connection does
+    if (bytes_read == 0) return 3;
+    chunk_adapt(x, bytes_read);
+    shape_charge(x, bytes_read);
+    stats_add(STAT_RECV_COPY_BYTES, bytes_read);
+    x->z.next_in = x->buf;
+    x->z.avail_in = bytes_read;
+  }
+
+  x->z.next_out = x->zbuf;
+  x->z.avail_out = ZBUF_SIZE;
+  int ret = inflate(&x->z, Z_NO_FLUSH);
+  if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) return 4;
+  fwrite(x->zbuf, 1, ZBUF_SIZE - x->z.avail_out, x->fp);
+  if (x->hashing) digest_update(&x->dg, x->zbuf, ZBUF_SIZE - x->z.avail_out);
+  if (ferror(x->fp) != 0) return 2;
+  // Anything after the end of the stream is ignored
+  if (ret == Z_STREAM_END) return 1;
+  return 0;
+}
+
+// Starts the inline digest from the current offset of the file
+static inline bool dg_setup(xfer *x)
+{
+  if (fstat(fileno(x->fp), &x->dg_st) != 0 ||
+      !digest_init(&x->dg, x->dg_algo))
+    return false;
+  x->dg_start = ftello(x->fp);
+  x->dg_ready = true;
+  return true;
+}
+
+// Enters a download into the scheduling, in the class of its size
+static inline void sched_setup(xfer *x)
+{
+  int64_t left = -1;
+  struct stat st;
+  if (x->dat_type == DATA_SEND_FILE && fstat(fileno(x->fp), &st) == 0)
+    left = st.st_size - ftello(x->fp);
+  sched_flow_init(&x->flow, sched_classify(left), x->wake_fd);
+  x->sched_ready = true;
+}
+
+// 0 - Continue, after waiting for `x->sched_wait`, `x->delay_us` or
+//     `x->wait_events` if set
 // 1 - Completed normally
 // 2 - Aborted abnormally
-static inline int process_block(
-  client *c,
-  int conn_fd, enum dat_type_t dat_type, FILE *fp, void *buf,
-  int *process_sleep)
-{
-  bool xfer_complete;
-  if (dat_type == DATA_SEND_FILE || dat_type == DATA_SEND_PIPE) {
-    size_t bytes_read = fread(buf, 1, BUF_SIZE, fp);
-    if (bytes_read > 0) {
-      write_all(conn_fd, buf, bytes_read);
-    #ifdef SLOW_DATA
-      usleep(300000);
-    #endif
-    }
-    xfer_complete = feof(fp);
-  } else /* if (dat_type == DATA_RECV_FILE) */ {
-    ssize_t bytes_read = read(conn_fd, buf, BUF_SIZE);
+// 3 - Connection failed, or in block mode or MODE Z, closed before the
+//     end of the file
+// 4 - MODE Z: corrupt compressed data
+static inline int process_block(client *c, xfer *x)
+{
+  x->wait_events = 0;
+  if (x->hashing && !x->dg_ready && !dg_setup(x)) return 2;
+
+  // Nothing crosses the connection while a rate limit is in debt
+  x->shape_dir = (x->dat_type == DATA_RECV_FILE ? SHAPER_UP : SHAPER_DOWN);
+  x->delay_us = 0;
+  x->sched_wait = false;
+  x->quota = shaper_grant(x->shaper, x->shape_dir, x->chunk, &x->delay_us);
+  if (x->quota == 0) return 0;
+  // Downloads then wait for their turn on the link
+  if (x->shape_dir == SHAPER_DOWN) {
+    if (!x->sched_ready) sched_setup(x);
+    x->quota = sched_take(&x->flow, x->quota);
+    if (x->quota == 0) {
+      x->sched_wait = true;
+      return 0;
+    }
+  }
+
+  if (x->deflate)
+    return (x->dat_type == DATA_RECV_FILE ? recv_inflate(x) : send_deflate(x));
+
+  if (x->block) {
+    int st = (x->dat_type == DATA_RECV_FILE ?
+      blk_recv_next(x) : blk_send_next(x));
+    if (st != -1) return st;
+  }
+
+  // Restart markers are read into the buffer and dropped, and data to be
+  // digested has to pass through it as well
+  if (x->zero_copy && !x->hashing &&
+      !(x->block && (x->blk_desc & BLK_RESTART))) {
+    int st = -1;
+    if (x->dat_type == DATA_SEND_FILE) st = send_file_zero_copy(x);
+    else if (x->dat_type == DATA_RECV_FILE) st = recv_file_zero_copy(x);
+    if (st != -1) return st;
+    // Not supported, fall back to copying for the rest of the transfer
+    if (x->dat_type == DATA_SEND_FILE || x->dat_type == DATA_RECV_FILE)
+      x->zero_copy = false;
+  }
+
+  if (x->dat_type != DATA_RECV_FILE) {
+    bool full_read = false;
+    if (x->out_len == 0) {
+      if (x->dat_type == DATA_SEND_FILE) {
+        buf_reserve(x);
+        size_t count = x->chunk;
+        if (x->block && count > x->blk_left) count = x->blk_left;
+        size_t bytes_read = fread(x->buf, 1, count, x->fp);
+        if (bytes_read == 0)
+          return (ferror(x->fp) != 0 || x->block ? 2 : 1);
+        full_read = (bytes_read == x->chunk);
+        if (x->hashing) digest_update(&x->dg, x->buf, bytes_read);
+        x->out = x->buf;
+        x->out_len = bytes_read;
+      } else if (x->dat_type == DATA_SEND_LIST) {
+        ssize_t len = lister_next(x->ls, &x->out);
+        if (len < 0) return 2;
+        if (len == 0) {
+          if (x->ticket != 0)
+            lscache_put(lister_format(x->ls), x->path, x->ticket,
+              x->acc, x->acc_len);
+          x->ticket = 0;
+          if (!x->block) return 1;
+          blk_start(x, 0, BLK_EOF);
+          return 0;
+        }
+        // Listings too large for the cache are not kept in memory
+        if (x->ticket != 0 && !lscache_fits(x->acc_len + len)) x->ticket = 0;
+        if (x->ticket != 0) acc_append(x, x->out, len);
+        x->out_len = len;
+      } else /* if (x->dat_type == DATA_SEND_CACHED) */ {
+        if (!x->block) return 1;
+        blk_start(x, 0, BLK_EOF);
+        return 0;
+      }
+    }
+    // Listings are framed as they come
+    if (x->block && x->blk_left == 0) {
+      blk_start(x, x->out_len < BLK_MAX ? x->out_len : BLK_MAX, 0);
+      return 0;
+    }
+    size_t count = shape_cap(x, x->out_len);
+    if (x->block && count > x->blk_left) count = x->blk_left;
+    ssize_t bytes_sent = write(x->conn_fd, x->out, count);
+    if (bytes_sent == -1) {
+      if (errno == EAGAIN) {
+        chunk_adapt(x, 0);
+        x->wait_events = POLLOUT;
+        return 0;
+      }
+      warn("write() failed");
+      return 2;
+    }
+    // Only a partial write is back-pressure, a short final read is not
+    if ((size_t)bytes_sent < count) chunk_adapt(x, bytes_sent);
+    else if (full_read) chunk_adapt(x, bytes_sent);
+    shape_charge(x, bytes_sent);
+    x->out += bytes_sent;
+    x->out_len -= bytes_sent;
+    if (x->block) x->blk_left -= bytes_sent;
+    stats_add(STAT_SEND_COPY_BYTES, bytes_sent);
+  #ifdef SLOW_DATA
+    usleep(300000);
+  #endif
+    return 0;
+  } else /* if (x->dat_type == DATA_RECV_FILE) */ {
+    buf_reserve(x);
+    size_t count = shape_cap(x, x->chunk);
+    if (x->block && count > x->blk_left) count = x->blk_left;
+    ssize_t bytes_read = read(x->conn_fd, x->buf, count);
     if (bytes_read > 0) {
-      *process_sleep = 1000;
-      fwrite(buf, 1, bytes_read, fp);
+      chunk_adapt(x, bytes_read);
+      shape_charge(x, bytes_read);
+      if (x->block) x->blk_left -= bytes_read;
+      if (!(x->block && (x->blk_desc & BLK_RESTART))) {
+        fwrite(x->buf, 1, bytes_read, x->fp);
+        if (x->hashing) digest_update(&x->dg, x->buf, bytes_read);
+      }
+      stats_add(STAT_RECV_COPY_BYTES, bytes_read);
     } else if (bytes_read == -1) {
       if (errno == EAGAIN) {
-        usleep(*process_sleep);
-        double_and_limit(process_sleep, 200000);
-      } else {
-        warn("read() failed");
-        bytes_read = 0;   // Treat transfer as complete
+        x->wait_events = POLLIN;
+        return 0;
       }
+      warn("read() failed");
+      return 3;
     }
-    xfer_complete = (bytes_read == 0);
-  }
-  if (xfer_complete) {
-    return 1;
-  } else if (ferror(fp) != 0) {
-    return 2;
+    if (bytes_read == 0) return (x->block ? 3 : 1);
+    return (ferror(x->fp) != 0 ? 2 : 0);
   }
-  return 0;
 }
 
-static inline void cleanup(
-  client *c,
-  int conn_fd, enum dat_type_t dat_type, FILE *fp, void *buf, int st)
+// Releases the transfer and sends its final reply, after which
+// the data job may take over the next one
+static inline void xfer_finish(client *c, xfer *x, int st)
 {
-  if (conn_fd != -1) close(conn_fd);
+  // Also release a transfer handed over but never picked up
+  crit({
+    xfer_take(c, x);
+    c->dat_fp = NULL;
+    c->dat_ls = NULL;
+    c->dat_blob = NULL;
+    c->dat_path = NULL;
+    c->dat_ticket = 0;
+  });
 
-  free(buf);
-  if (fp != NULL) {
-    if (dat_type == DATA_SEND_PIPE) pclose(fp);
-    else fclose(fp);
+  // Written data is flushed for the final size and modification time
+  struct stat fst;
+  bool fst_ok = false;
+  if (x->fp != NULL) {
+    if (x->dat_type == DATA_RECV_FILE && fflush(x->fp) != 0 && st == 1) st = 2;
+    fst_ok = (fstat(fileno(x->fp), &fst) == 0);
   }
+  // Digests taken while the upload was under way are stale
+  if (fst_ok && x->dat_type == DATA_RECV_FILE) hashcache_invalidate(&fst);
 
-  crit({ c->dat_fp = NULL; });
-  c->state = CLST_READY;
+  // The inline digest is the file's if it started at the beginning and,
+  // for downloads, the file has not changed since
+  char hex[DIGEST_HEX_MAX];
+  if (x->dg_ready && st == 1) {
+    digest_final(&x->dg, hex);
+    x->dg_ready = false;
+    if (fst_ok && x->dg_start == 0 && (x->dat_type == DATA_RECV_FILE ||
+        (fst.st_size == x->dg_st.st_size &&
+         fst.st_mtim.tv_sec == x->dg_st.st_mtim.tv_sec &&
+         fst.st_mtim.tv_nsec == x->dg_st.st_mtim.tv_nsec)))
+      hashcache_put(&fst, x->dg_algo, hex);
+    if (x->dg_expect[0] != '\0' && strcasecmp(hex, x->dg_expect) != 0) st = 5;
+  }
 
-  info("data thread terminated");
+  if (x->fp != NULL && fclose(x->fp) != 0 && st == 1) st = 2;
+  if (x->ls != NULL) lister_close(x->ls);
+  if (x->blob != NULL) lsblob_release(x->blob);
+  if (x->path != NULL) {
+    // Written files have changed since the listing was rendered
+    if (x->dat_type == DATA_RECV_FILE) path_changed(x->path);
+    free(x->path);
+  }
+  z_reset(x);
 
-  if (st == 1)
+  if (st == 1 && x->block)
+    mark(250, "Transfer complete. Data connection kept open.");
+  else if (st == 1)
     mark(226, "Transfer complete.");
   else if (st == 2)
     mark(451, "Transfer aborted by internal I/O error.");
+  else if (st == 3)
+    mark(426, "Data connection lost before the end of the file.");
+  else if (st == 4)
+    mark(426, "Transfer aborted: corrupt compressed data.");
+  else if (st == 5)
+    markf(550, "Transfer complete, but the %s digest %s is not the one "
+      "expected.", digest_names[x->dg_algo], hex);
+  else if (st == 6)
+    mark(425, "Cannot open data connection: timed out.");
+  else if (st == 7)
+    mark(425, "Cannot establish connection.");
+  else if (st == 8)
+    mark(425, "Cannot open data connection.");
+
+  x->dat_type = DATA_UNDEFINED;
+  x->fp = NULL;
+  x->ls = NULL;
+  x->blob = NULL;
+  x->path = NULL;
+  x->out = NULL;
+  x->out_len = 0;
+  x->ticket = 0;
+  x->acc_len = 0;
+  x->spliced = false;
+  blk_reset(x);
+  dg_reset(x);
+  if (x->sched_ready) sched_leave(&x->flow);
+  x->sched_ready = false;
+
+  // Commands queued behind the transfer may run from here on
+  crit({ c->dat_type = DATA_UNDEFINED; });
+  reactor_wake(c);
 }
 
-// Active mode
+// Frees what the data job holds apart from the transfer
+static inline void xfer_release(xfer *x)
+{
+  if (x->pipe_fds[0] != -1) {
+    close(x->pipe_fds[0]);
+    close(x->pipe_fds[1]);
+  }
+  free(x->buf);
+  free(x->acc);
+}
 
-static void *active_data(void *arg)
+// Ends the data job along with the data connection, after which PORT or
+// PASV has to be given again
+static inline void cleanup(client *c, xfer *x, int st)
 {
-  client *c = (client *)arg;
+  if (x->conn_fd != -1) close(x->conn_fd);
+  if (c->sock_pasv != -1) {
+    close(c->sock_pasv);
+    c->sock_pasv = -1;
+  }
 
-  int conn_fd = -1;
-  FILE *fp = NULL;
-  enum dat_type_t dat_type = DATA_UNDEFINED;
-  void *buf = malloc(BUF_SIZE);
-  int st = 0;
+  c->state = CLST_READY;
 
-  // Wait for the file
+  info("data thread terminated");
+
+  xfer_finish(c, x, st);
+  xfer_release(x);
+
+  // The session may be released as soon as this is observed
   crit({
-    pthread_cond_wait(&c->cond_dat, &c->mutex_dat);
-    fp = c->dat_fp; dat_type = c->dat_type;
+    c->thr_dat_busy = false;
+    pthread_cond_broadcast(&c->cond_dat);
   });
+}
 
-  // Establish connection
-  conn_fd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
-  if (conn_fd == -1) {
-    mark(425, "Cannot establish connection: socket() failed.");
-    goto _cleanup;
+// Active mode: connects to the client
+// Returns 0 once connected or when the job is asked to stop, otherwise
+// the status to end the transfer with
+static inline int xfer_connect(client *c, xfer *x)
+{
+  int fd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+    IPPROTO_TCP);
+  if (fd == -1) {
+    warn("socket() failed");
+    return 7;
   }
+  // Before connecting, so that the window scale is negotiated accordingly
+  sock_buf_setup(fd);
 
   // Fill in the address from client record
   struct sockaddr_in addr = { 0 };
   addr.sin_family = AF_INET;
   memcpy(&addr.sin_addr.s_addr, c->addr, 4);
   addr.sin_port = htons(c->port);
-  // TODO: Connect with a timeout
-  if (connect(conn_fd, (struct sockaddr *)&addr, sizeof addr) == -1) {
-    mark(425, "Cannot establish connection.");
-    goto _cleanup;
+  if (connect(fd, (struct sockaddr *)&addr, sizeof addr) == -1) {
+    if (errno != EINPROGRESS) {
+      close(fd);
+      return 7;
+    }
+    // Wait for the handshake, stopping early on ABOR or the end of session
+    uint64_t deadline = monotonic_ms() + CONNECT_TIMEOUT_MS;
+    int ready;
+    while (1) {
+      uint64_t now = monotonic_ms();
+      ready = (now < deadline ?
+        xfer_poll(x, fd, POLLOUT, deadline - now) : -1);
+      if (ready != 0) break;
+      bool running;
+      crit({ running = c->thr_dat_running; });
+      if (!running) {
+        close(fd);
+        return 0;
+      }
+    }
+    int err = ETIMEDOUT;
+    socklen_t len = sizeof err;
+    if (ready == 1)
+      getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    if (err != 0) {
+      close(fd);
+      return 7;
+    }
   }
-  fcntl(conn_fd, F_SETFL, fcntl(conn_fd, F_GETFL, 0) | O_NONBLOCK);
 
-  int process_sleep = 1000;
+  x->conn_fd = fd;
+  return 0;
+}
 
-  while (1) {
-    bool running;
-    crit({ running = c->thr_dat_running; });
-    if (!running) break;
+// Records the time from PASV to the client's connection
+static inline void pasv_accepted(client *c)
+{
+  if (c->pasv_at == 0) return;
+  uint64_t latency = monotonic_us() - c->pasv_at;
+  c->pasv_at = 0;
+  stats_add(STAT_PASV_ACCEPTS, 1);
+  stats_add(STAT_PASV_ACCEPT_US, latency);
+  stats_max(STAT_PASV_ACCEPT_US_MAX, latency);
+}
 
-    if ((st = process_block(c, conn_fd, dat_type, fp, buf, &process_sleep))
-        != 0)
-      break;
+// Passive mode: accepts the client's connection, waiting for it until
+// `*accept_by`, set on the first call
+// Returns 0 once connected or woken up, otherwise the status to end the
+// transfer with
+static inline int xfer_accept(client *c, xfer *x, uint64_t *accept_by)
+{
+  int fd = accept4(c->sock_pasv, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (fd != -1) {
+    x->conn_fd = fd;
+    pasv_accepted(c);
+    return 0;
+  }
+  if (errno == EINTR || errno == ECONNABORTED) return 0;
+  if (errno != EAGAIN) {
+    warn("accept4() failed");
+    return 8;
   }
 
-_cleanup:
-  cleanup(c, conn_fd, dat_type, fp, buf, st);
-  return NULL;
+  uint64_t now = monotonic_ms();
+  if (*accept_by == 0) *accept_by = now + CONNECT_TIMEOUT_MS;
+  if (now >= *accept_by ||
+      xfer_poll(x, c->sock_pasv, POLLIN, *accept_by - now) == -1)
+    return 6;
+  return 0;
 }
 
-// Passive mode
-
-struct passive_data_arg {
-  int sock_fd;
-  client *c;
-};
-
-static void *passive_data(void *arg)
+// Runs the transfer handed over by the session, opening the data
+// connection for it unless one is kept from the previous transfer, and
+// those handed over before it completes. Between transfers the job does
+// not hold a worker: a block mode connection is left to the session, and
+// the reactor waits for the client to connect in passive mode.
+static void *data_job(void *arg)
 {
-  int sock_fd = ((struct passive_data_arg *)arg)->sock_fd;
-  client *c = ((struct passive_data_arg *)arg)->c;
-  free(arg);
+  client *c = (client *)arg;
 
-  int conn_fd = -1;
-  FILE *fp = NULL;
-  enum dat_type_t dat_type = DATA_UNDEFINED;
-  void *buf = malloc(BUF_SIZE);
+  xfer x;
+  xfer_init(&x);
+  x.wake_fd = c->evfd_dat;
+  x.shaper = &c->shaper;
   int st = 0;
+  uint64_t accept_by = 0;   // Passive mode: deadline for the client to connect
 
-  int accept_sleep = 1000;
-  int process_sleep = 1000;
+  crit({
+    x.conn_fd = c->dat_conn;
+    c->dat_conn = -1;
+    xfer_take(c, &x);
+  });
+  // Uploads may have been sent and closed before the command arrived
+  if (x.conn_fd != -1 && x.dat_type != DATA_RECV_FILE && hung_up(x.conn_fd)) {
+    close(x.conn_fd);
+    x.conn_fd = -1;
+  }
 
   while (1) {
-    bool running;
-    crit({ running = c->thr_dat_running; });
-    if (!running) break;
-
-    if (conn_fd == -1) {
-      if ((conn_fd = accept(sock_fd, NULL, NULL)) == -1) {
-        if (errno == EAGAIN) {
-          usleep(accept_sleep);
-          double_and_limit(&accept_sleep, 200000);
-          continue;
-        } else {
-          panic("accept() failed");
-        }
+    bool running, left = false;
+    crit({
+      running = c->thr_dat_running;
+      xfer_take(c, &x);
+      // Block mode: the connection goes back to the session unless another
+      // transfer has been handed over meanwhile
+      if (running && x.dat_type == DATA_UNDEFINED) {
+        c->dat_conn = x.conn_fd;
+        c->dat_idle_at = idle_deadline();
+        reactor_wake(c);
+        c->thr_dat_busy = false;
+        pthread_cond_broadcast(&c->cond_dat);
+        left = true;
       }
+    });
+    if (left) {
+      xfer_release(&x);
+      return NULL;
     }
+    if (!running) break;
 
-    if (conn_fd != -1) {
-      if (fp == NULL)
-        crit({ fp = c->dat_fp; dat_type = c->dat_type; });
-      if (fp != NULL) {
-        if ((st = process_block(c, conn_fd, dat_type, fp, buf, &process_sleep))
-            != 0)
-          break;
-      } else {
-        // Connected and no file present. Detect disconnection.
-        // Ref: http://stefan.buettcher.org/cs/conn_closed.html
-        struct pollfd poll_fd;
-        char c;
-        poll_fd.fd = conn_fd;
-        poll_fd.events = POLLIN | POLLHUP;
-        poll_fd.revents = 0;
-        if (poll(&poll_fd, 1, 100) > 0 && (poll_fd.revents & POLLHUP)
-            && recv(conn_fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == 0) {
-          close(conn_fd);
-          conn_fd = -1;
-        }
-      }
+    if (x.conn_fd == -1) {
+      st = (c->state == CLST_PASV ?
+        xfer_accept(c, &x, &accept_by) : xfer_connect(c, &x));
+      if (st != 0) break;
+    } else if ((st = process_block(c, &x)) == 1 && x.block) {
+      xfer_finish(c, &x, st);
+      st = 0;
+    } else if (st != 0) {
+      break;
+    } else if (x.sched_wait) {
+      xfer_wait(&x, -1, 0);
+    } else if (x.delay_us != 0) {
+      xfer_delay(&x);
+    } else if (x.wait_events != 0) {
+      xfer_wait(&x, x.conn_fd, x.wait_events);
     }
   }
 
-  close(sock_fd);
-  cleanup(c, conn_fd, dat_type, fp, buf, st);
+  cleanup(c, &x, st);
   return NULL;
 }
-
-#undef BUF_SIZE
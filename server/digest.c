@@ -0,0 +1,192 @@
+#include "digest.h"
+#include "io_utils.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+// Bytes read from a file at a time
+#define READ_CHUNK  (1024 * 1024)
+
+const char *digest_names[DIGEST_COUNT] = {
+  [DIGEST_CRC32] = "CRC32",
+  [DIGEST_CRC32C] = "CRC32C",
+  [DIGEST_MD5] = "MD5",
+  [DIGEST_SHA1] = "SHA-1",
+  [DIGEST_SHA256] = "SHA-256",
+  [DIGEST_SHA512] = "SHA-512",
+};
+
+static const uint8_t digest_sizes[DIGEST_COUNT] = {
+  [DIGEST_CRC32] = 4,
+  [DIGEST_CRC32C] = 4,
+  [DIGEST_MD5] = 16,
+  [DIGEST_SHA1] = 20,
+  [DIGEST_SHA256] = 32,
+  [DIGEST_SHA512] = 64,
+};
+
+digest_algo digest_lookup(const char *name)
+{
+  for (int i = 0; i < DIGEST_COUNT; i++)
+    if (strcasecmp(name, digest_names[i]) == 0) return i;
+  return DIGEST_COUNT;
+}
+
+size_t digest_hex_len(digest_algo algo)
+{
+  return digest_sizes[algo] * 2;
+}
+
+// CRC32C (Castagnoli), reflected
+
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+static uint32_t crc32c_table[256];
+static bool crc32c_has_sse42 = false;
+
+static void crc32c_setup()
+{
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; k++) c = (c >> 1) ^ (c & 1 ? 0x82f63b78 : 0);
+    crc32c_table[i] = c;
+  }
+#if defined(__x86_64__)
+  crc32c_has_sse42 = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+  while (len-- > 0) crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+  uint64_t c = crc;
+  for (; len >= 8; p += 8, len -= 8) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    c = _mm_crc32_u64(c, v);
+  }
+  crc = (uint32_t)c;
+  while (len-- > 0) crc = _mm_crc32_u8(crc, *p++);
+  return crc;
+}
+#endif
+
+static uint32_t crc32c_update(uint32_t crc, const unsigned char *p, size_t len)
+{
+#if defined(__x86_64__)
+  if (crc32c_has_sse42) return crc32c_hw(crc, p, len);
+#endif
+  return crc32c_sw(crc, p, len);
+}
+
+bool digest_init(digest *d, digest_algo algo)
+{
+  d->algo = algo;
+  d->crc = 0;
+  d->md = NULL;
+
+  const EVP_MD *md = NULL;
+  switch (algo) {
+    case DIGEST_CRC32: return true;
+    case DIGEST_CRC32C:
+      pthread_once(&crc32c_once, crc32c_setup);
+      d->crc = 0xffffffff;
+      return true;
+    case DIGEST_MD5: md = EVP_md5(); break;
+    case DIGEST_SHA1: md = EVP_sha1(); break;
+    case DIGEST_SHA256: md = EVP_sha256(); break;
+    case DIGEST_SHA512: md = EVP_sha512(); break;
+    default: return false;
+  }
+
+  if ((d->md = EVP_MD_CTX_new()) == NULL) return false;
+  if (EVP_DigestInit_ex(d->md, md, NULL) != 1) {
+    EVP_MD_CTX_free(d->md);
+    d->md = NULL;
+    return false;
+  }
+  return true;
+}
+
+void digest_update(digest *d, const void *data, size_t len)
+{
+  if (d->algo == DIGEST_CRC32)
+    d->crc = crc32_z(d->crc, data, len);
+  else if (d->algo == DIGEST_CRC32C)
+    d->crc = crc32c_update(d->crc, data, len);
+  else
+    EVP_DigestUpdate(d->md, data, len);
+}
+
+size_t digest_final(digest *d, char *hex)
+{
+  if (d->algo == DIGEST_CRC32)
+    return sprintf(hex, "%08x", d->crc);
+  if (d->algo == DIGEST_CRC32C)
+    return sprintf(hex, "%08x", ~d->crc);
+
+  unsigned char out[EVP_MAX_MD_SIZE];
+  unsigned int n = 0;
+  EVP_DigestFinal_ex(d->md, out, &n);
+  EVP_MD_CTX_free(d->md);
+  d->md = NULL;
+  for (unsigned int i = 0; i < n; i++) sprintf(hex + i * 2, "%02x", out[i]);
+  hex[n * 2] = '\0';
+  return n * 2;
+}
+
+void digest_abandon(digest *d)
+{
+  if (d->md != NULL) EVP_MD_CTX_free(d->md);
+  d->md = NULL;
+}
+
+int digest_file(int fd, digest_algo algo, off_t start, off_t end,
+  const bool *cancel, char *hex)
+{
+  digest d;
+  if (!digest_init(&d, algo)) return -1;
+  unsigned char *buf = malloc(READ_CHUNK);
+  posix_fadvise(fd, start, end == -1 ? 0 : end - start,
+    POSIX_FADV_SEQUENTIAL);
+
+  int ret = 0;
+  for (off_t offs = start; end == -1 || offs < end; ) {
+    if (__atomic_load_n(cancel, __ATOMIC_RELAXED)) {
+      ret = 1;
+      break;
+    }
+    size_t len = READ_CHUNK;
+    if (end != -1 && (off_t)len > end - offs) len = end - offs;
+    ssize_t n = pread(fd, buf, len, offs);
+    if (n == -1) {
+      warn("pread() failed");
+      ret = -1;
+      break;
+    }
+    if (n == 0) break;
+    digest_update(&d, buf, n);
+    offs += n;
+  }
+
+  free(buf);
+  if (ret == 0) digest_final(&d, hex);
+  else digest_abandon(&d);
+  return ret;
+}
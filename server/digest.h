@@ -0,0 +1,57 @@
+#ifndef zzftp__digest_h
+#define zzftp__digest_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <openssl/evp.h>
+
+// Checksums and message digests for HASH and XCRC and the like
+// CRC32C uses the SSE4.2 instruction where available, and the others
+// go through OpenSSL, which picks SHA-NI or AVX2 code at run time
+
+typedef enum digest_algo_e {
+  DIGEST_CRC32,
+  DIGEST_CRC32C,
+  DIGEST_MD5,
+  DIGEST_SHA1,
+  DIGEST_SHA256,
+  DIGEST_SHA512,
+  DIGEST_COUNT
+} digest_algo;
+
+// Hexadecimal digest of the longest algorithm, and the terminator
+#define DIGEST_HEX_MAX  129
+
+// Names as listed by FEAT, e.g. "SHA-256"
+extern const char *digest_names[DIGEST_COUNT];
+
+// Finds an algorithm by its name, ignoring case
+// Returns DIGEST_COUNT if there is none
+digest_algo digest_lookup(const char *name);
+// Length of the hexadecimal digest of an algorithm
+size_t digest_hex_len(digest_algo algo);
+
+typedef struct digest_s {
+  digest_algo algo;
+  uint32_t crc;       // CRC32, CRC32C
+  EVP_MD_CTX *md;     // Others
+} digest;
+
+bool digest_init(digest *d, digest_algo algo);
+void digest_update(digest *d, const void *data, size_t len);
+// Writes the digest in lowercase hexadecimal and releases the state
+// Returns the length of the string
+size_t digest_final(digest *d, char *hex);
+// Releases the state without a result
+void digest_abandon(digest *d);
+
+// Digests bytes from `start` up to `end` (exclusive, or -1 for the end of
+// the file) of an open file into `hex`, reading it in large chunks
+// Returns 0 on success, 1 if `*cancel` got set meanwhile, -1 on errors
+int digest_file(int fd, digest_algo algo, off_t start, off_t end,
+  const bool *cancel, char *hex);
+
+#endif
@@ -0,0 +1,174 @@
+#include "hashcache.h"
+#include "io_utils.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include <zlib.h>
+
+// Entries are grouped in sets of WAYS by file, so that the digests of
+// one file in all algorithms share a set and a lock
+// Each lock guards every NUM_LOCKS-th set
+#define WAYS        8
+#define NUM_LOCKS   64
+
+#define MAGIC       "zzFTPhc1"
+
+typedef struct header_s {
+  char magic[8];
+  uint64_t num_sets;
+  uint64_t entry_size;
+  char pad[40];
+} header;
+
+typedef struct entry_s {
+  uint64_t dev, ino, size;
+  int64_t mtime_ns;
+  uint8_t algo;       // digest_algo + 1, 0 if empty
+  uint8_t len;        // Bytes of the digest
+  uint8_t pad[2];
+  uint32_t check;     // CRC of the entry, to discard those torn by a crash
+  uint8_t digest[64];
+} entry;
+
+static pthread_mutex_t locks[NUM_LOCKS];
+static entry *entries = NULL;
+static size_t num_sets = 0;
+
+static inline int64_t mtime_ns(const struct stat *st)
+{
+  return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+static size_t set_of(const struct stat *st)
+{
+  uint64_t h = (uint64_t)st->st_ino * 0x9e3779b97f4a7c15ull ^ st->st_dev;
+  h ^= h >> 31;
+  h *= 0xbf58476d1ce4e5b9ull;
+  h ^= h >> 29;
+  return h % num_sets;
+}
+
+static uint32_t entry_check(const entry *e)
+{
+  return crc32_z(0, (const unsigned char *)e, offsetof(entry, check)) ^
+    crc32_z(0, e->digest, e->len);
+}
+
+void hashcache_init(const char *path, size_t num_entries)
+{
+  if (num_entries == 0) return;
+  size_t n = (num_entries + WAYS - 1) / WAYS;
+  size_t size = sizeof(header) + n * WAYS * sizeof(entry);
+
+  header h = { 0 };
+  bool valid = false;
+  void *p;
+  if (path == NULL) {
+    // Zero-filled, so every entry starts out empty
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) panic("Cannot map the checksum cache");
+  } else {
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1) panic("Cannot open the checksum cache");
+    valid = (read(fd, &h, sizeof h) == sizeof h &&
+      memcmp(h.magic, MAGIC, 8) == 0 && h.num_sets == n &&
+      h.entry_size == sizeof(entry) && lseek(fd, 0, SEEK_END) == (off_t)size);
+    if (!valid && ftruncate(fd, 0) != 0)
+      panic("Cannot reset the checksum cache");
+    if (ftruncate(fd, size) != 0)
+      panic("Cannot size the checksum cache");
+
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) panic("Cannot map the checksum cache");
+    close(fd);
+  }
+
+  if (!valid) {
+    memcpy(h.magic, MAGIC, 8);
+    h.num_sets = n;
+    h.entry_size = sizeof(entry);
+    memcpy(p, &h, sizeof h);
+  }
+
+  for (int i = 0; i < NUM_LOCKS; i++) pthread_mutex_init(&locks[i], NULL);
+  entries = (entry *)((char *)p + sizeof(header));
+  num_sets = n;
+}
+
+bool hashcache_get(const struct stat *st, digest_algo algo, char *hex)
+{
+  if (entries == NULL) return false;
+
+  size_t set = set_of(st);
+  entry *e = &entries[set * WAYS];
+  bool found = false;
+
+  pthread_mutex_lock(&locks[set % NUM_LOCKS]);
+  for (int i = 0; i < WAYS; i++, e++) {
+    if (e->algo != algo + 1 || e->dev != st->st_dev || e->ino != st->st_ino)
+      continue;
+    if (e->size == st->st_size && e->mtime_ns == mtime_ns(st) &&
+        e->len <= sizeof e->digest && e->check == entry_check(e)) {
+      for (int k = 0; k < e->len; k++) sprintf(hex + k * 2, "%02x", e->digest[k]);
+      hex[e->len * 2] = '\0';
+      found = true;
+    }
+    break;
+  }
+  pthread_mutex_unlock(&locks[set % NUM_LOCKS]);
+  return found;
+}
+
+void hashcache_put(const struct stat *st, digest_algo algo, const char *hex)
+{
+  if (entries == NULL) return;
+  size_t len = strlen(hex) / 2;
+  if (len > sizeof ((entry *)0)->digest) return;
+
+  size_t set = set_of(st);
+  entry *base = &entries[set * WAYS];
+
+  pthread_mutex_lock(&locks[set % NUM_LOCKS]);
+  // The same file and algorithm, an empty way, or else a victim that
+  // varies with the time
+  entry *e = NULL;
+  for (int i = 0; i < WAYS && e == NULL; i++)
+    if (base[i].algo == algo + 1 &&
+        base[i].dev == st->st_dev && base[i].ino == st->st_ino)
+      e = &base[i];
+  for (int i = 0; i < WAYS && e == NULL; i++)
+    if (base[i].algo == 0) e = &base[i];
+  if (e == NULL) e = &base[(mtime_ns(st) ^ monotonic_ms()) % WAYS];
+
+  e->dev = st->st_dev;
+  e->ino = st->st_ino;
+  e->size = st->st_size;
+  e->mtime_ns = mtime_ns(st);
+  e->algo = algo + 1;
+  e->len = len;
+  memset(e->pad, 0, sizeof e->pad);
+  for (size_t k = 0; k < len; k++) sscanf(hex + k * 2, "%2hhx", &e->digest[k]);
+  e->check = entry_check(e);
+  pthread_mutex_unlock(&locks[set % NUM_LOCKS]);
+}
+
+void hashcache_invalidate(const struct stat *st)
+{
+  if (entries == NULL) return;
+
+  size_t set = set_of(st);
+  entry *e = &entries[set * WAYS];
+
+  pthread_mutex_lock(&locks[set % NUM_LOCKS]);
+  for (int i = 0; i < WAYS; i++, e++)
+    if (e->dev == st->st_dev && e->ino == st->st_ino) e->algo = 0;
+  pthread_mutex_unlock(&locks[set % NUM_LOCKS]);
+}
@@ -0,0 +1,28 @@
+#ifndef zzftp__hashcache_h
+#define zzftp__hashcache_h
+
+#include "digest.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+// A persistent cache of whole-file digests, kept in a memory-mapped file
+// so that it survives restarts
+// Entries are keyed by device, inode, size, modification time and
+// algorithm; a file that changes gets a new key, and the server also
+// drops the entries of files it writes, replaces or removes
+
+// Enables the cache, stored in `path` with room for `num_entries`
+// A file of another size or format is started over
+// With a NULL path, the cache is kept in memory only
+void hashcache_init(const char *path, size_t num_entries);
+
+// Looks up the digest of a file, written in hexadecimal to `hex`
+bool hashcache_get(const struct stat *st, digest_algo algo, char *hex);
+// Stores the digest of a file, in hexadecimal
+void hashcache_put(const struct stat *st, digest_algo algo, const char *hex);
+// Drops all digests of a file
+void hashcache_invalidate(const struct stat *st);
+
+#endif
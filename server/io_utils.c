@@ -1,9 +1,12 @@
 #include "io_utils.h"
 
 #include <errno.h>
+#include <poll.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <arpa/inet.h>
@@ -30,16 +33,40 @@ void info(const char *msg)
 #endif
 }
 
+// Time to wait for a stalled peer in read_all() and write_all()
+#define IO_TIMEOUT_MS   30000
+
+uint64_t monotonic_ms()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+// Waits for a non-blocking descriptor to become ready
+static bool wait_ready(int fd, short events)
+{
+  struct pollfd poll_fd = { .fd = fd, .events = events };
+  int result;
+  while ((result = poll(&poll_fd, 1, IO_TIMEOUT_MS)) == -1 && errno == EINTR) { }
+  if (result == 0) errno = ETIMEDOUT;
+  return result > 0;
+}
+
+uint64_t monotonic_us()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
 size_t read_all(int fd, void *buf, size_t len)
 {
   size_t result, tot = 0;
   while (tot < len) {
     result = read(fd, buf, len - tot);
     if (result == -1) {
-      if (errno == EAGAIN) {
-        usleep(1000);
-        continue;
-      }
+      if (errno == EAGAIN && wait_ready(fd, POLLIN)) continue;
       warn("read() failed");
       return tot;
     } else if (result == 0) {
@@ -57,10 +84,7 @@ size_t write_all(int fd, const void *buf, size_t len)
   while (len != 0) {
     result = write(fd, buf, len);
     if (result == -1) {
-      if (errno == EAGAIN) {
-        usleep(1000);
-        continue;
-      }
+      if (errno == EAGAIN && wait_ready(fd, POLLOUT)) continue;
       warn("write() failed");
       return len;
     }
@@ -70,66 +94,76 @@ size_t write_all(int fd, const void *buf, size_t len)
   return 0;
 }
 
-#define RLBUF_BUFSIZE   1024
+// Holds several pipelined commands, read with one call
+#define RLBUF_BUFSIZE   4096
 
 void rlb_init(rlb *b, int fd)
 {
   b->fd = fd;
-  b->buf = malloc(RLBUF_BUFSIZE);
+  // One more byte to terminate an unterminated last line
+  b->buf = malloc(RLBUF_BUFSIZE + 1);
   b->head = b->tail = b->buf;
   b->no_more = false;
+  b->discard = false;
+}
+
+bool rlb_fill(rlb *b)
+{
+  // Move the unconsumed content to the front
+  if (b->head != b->buf) {
+    memmove(b->buf, b->head, b->tail - b->head);
+    b->tail -= (b->head - b->buf);
+    b->head = b->buf;
+  }
+
+  while (!b->no_more && b->tail < b->buf + RLBUF_BUFSIZE) {
+    ssize_t result = read(b->fd, b->tail, b->buf + RLBUF_BUFSIZE - b->tail);
+    if (result == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+      if (errno == EINTR) continue;
+      warn("read() failed");
+      b->no_more = true;
+    } else if (result == 0) {
+      info("connection closed");
+      b->no_more = true;
+    } else {
+      b->tail += result;
+    }
+  }
+
+  return !b->no_more;
 }
 
-static inline char rlb_get_char(rlb *b)
-{
-  char c;
-  do {
-    // Check whether buffer has been all consumed
-    if (b->tail <= b->head) {
-      // Refill buffer
-      ssize_t result = read(b->fd, b->buf, RLBUF_BUFSIZE);
-      if (result == -1) {
-        warn("read() failed");
-        b->no_more = true;
-        return '\n';
-      } else if (result == 0) {
-        info("connection closed");
-        b->no_more = true;
-        return '\n';
-      }
-      b->head = b->buf;
-      b->tail = b->buf + result;
+ssize_t rlb_next_line(rlb *b, char **o_line)
+{
+  // Find the end of the line
+  char *p = memchr(b->head, '\n', b->tail - b->head);
+
+  if (p == NULL) {
+    if (b->discard || b->tail - b->head > RLB_LINE_MAX + 1) {
+      // The line is too long even without its CR-LF,
+      // drop what has been received
+      b->discard = true;
+      b->head = b->tail = b->buf;
+      return -1;
     }
-    c = *(b->head++);
-  } while (c == '\r');
-  return c;
-}
-
-size_t rlb_read_line(rlb *b, char *buf, size_t size)
-{
-  if (size == 0) return 0;
-  if (size == 1) { buf[0] = '\0'; return 0; }
-
-  size_t i;
-  for (i = 0; i < size; i++)
-    if ((buf[i] = rlb_get_char(b)) == '\n') { i++; break; }
-
-  // Truncate LF
-  if (buf[i - 1] == '\n') i--;
-
-  if (i == size) {
-    // Truncate extraneous content
-    char ch;
-    while ((ch = rlb_get_char(b)) != '\n') { }
-    // Return `size`
-    buf[i - 1] = '\0';
-    return size;
-  } else {
-    buf[i] = '\0';
-    // Return -1 on closed socket or error
-    if (i == 0 && b->no_more) return -1;
-    return i;
+    // An unterminated last line is still a line
+    if (!b->no_more || b->head == b->tail) return -1;
+    p = b->tail;
   }
+
+  char *line = b->head;
+  b->head = (p < b->tail ? p + 1 : p);
+
+  if (p > line && p[-1] == '\r') p--;
+  if (b->discard || p - line > RLB_LINE_MAX) {
+    b->discard = false;
+    return -2;
+  }
+
+  *p = '\0';
+  *o_line = line;
+  return p - line;
 }
 
 void rlb_deinit(rlb *b)
@@ -137,7 +171,28 @@ void rlb_deinit(rlb *b)
   free(b->buf);
 }
 
-void send_mark(int fd, int code, const char *msg)
+void reply_init(reply_buf *r)
+{
+  r->buf = r->msg = NULL;
+  r->len = r->cap = r->msg_cap = 0;
+}
+
+void reply_deinit(reply_buf *r)
+{
+  free(r->buf);
+  free(r->msg);
+}
+
+static void reply_reserve(reply_buf *r, size_t len)
+{
+  if (r->len + len > r->cap) {
+    r->cap = (r->len + len) * 2;
+    if (r->cap < 256) r->cap = 256;
+    r->buf = realloc(r->buf, r->cap);
+  }
+}
+
+void reply_add(reply_buf *r, int code, const char *msg)
 {
   char pfx[4];
   pfx[0] = '0' + (code / 100) % 10;
@@ -151,15 +206,68 @@ void send_mark(int fd, int code, const char *msg)
     size_t line_len = (p == NULL ? strlen(msg) : (p - msg));
 
     pfx[3] = (last_line ? ' ' : '-');
-    write_all(fd, pfx, 4);        // Prefix
-    write_all(fd, msg, line_len); // Line
-    write_all(fd, "\r\n", 2);     // EOL
+    reply_reserve(r, line_len + 6);
+    memcpy(r->buf + r->len, pfx, 4);              // Prefix
+    memcpy(r->buf + r->len + 4, msg, line_len);   // Line
+    memcpy(r->buf + r->len + 4 + line_len, "\r\n", 2);  // EOL
+    r->len += line_len + 6;
 
     msg = p + 1;
     if (last_line) break;
   }
 }
 
+void reply_addf(reply_buf *r, int code, const char *fmt, ...)
+{
+  va_list args;
+  while (1) {
+    va_start(args, fmt);
+    int len = vsnprintf(r->msg, r->msg_cap, fmt, args);
+    va_end(args);
+    if (len < 0) return;
+    if ((size_t)len < r->msg_cap) break;
+    r->msg_cap = len + 1;
+    r->msg = realloc(r->msg, r->msg_cap);
+  }
+  reply_add(r, code, r->msg);
+}
+
+void reply_raw(reply_buf *r, const char *data, size_t len)
+{
+  reply_reserve(r, len);
+  memcpy(r->buf + r->len, data, len);
+  r->len += len;
+}
+
+bool reply_flush(reply_buf *r, int fd)
+{
+  size_t sent = 0;
+  while (sent < r->len) {
+    ssize_t result = write(fd, r->buf + sent, r->len - sent);
+    if (result == -1) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN) break;
+      // The connection is lost, which its reader will find out
+      warn("write() failed");
+      sent = r->len;
+      break;
+    }
+    sent += result;
+  }
+  memmove(r->buf, r->buf + sent, r->len - sent);
+  r->len -= sent;
+  return r->len == 0;
+}
+
+void send_mark(int fd, int code, const char *msg)
+{
+  reply_buf r;
+  reply_init(&r);
+  reply_add(&r, code, msg);
+  reply_flush(&r, fd);
+  reply_deinit(&r);
+}
+
 int sock_ephemeral()
 {
   int sock_eph = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
@@ -5,6 +5,8 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <sys/types.h>
+
 // Prints errno with a message to stderr and exits the program
 void panic(const char *msg);
 // Prints errno with a message to stderr
@@ -12,30 +14,65 @@ void warn(const char *msg);
 // Prints a message to stderr
 void info(const char *msg);
 
+// Returns the value of the monotonic clock in milliseconds
+uint64_t monotonic_ms();
+// The same, in microseconds
+uint64_t monotonic_us();
+
 // Reads up to `len` bytes of data, stopping if read() returns 0
+// Non-blocking descriptors are waited on, giving up after a timeout
 // Returns the number of bytes read
 size_t read_all(int fd, void *buf, size_t len);
-// Writes `len` bytes of data
+// Writes `len` bytes of data, waiting in the same way
 // Returns the number of bytes remaining (0 if no errors occurred)
 size_t write_all(int fd, const void *buf, size_t len);
 
-// A read-line buffer
+// A read-line buffer over a non-blocking descriptor
+#define RLB_LINE_MAX  1023
 typedef struct rlb_s {
   int fd;
   char *buf, *head, *tail;
   bool no_more;
+  bool discard;   // Skipping the rest of an overlong line
 } rlb;
 
 // Prepares for reading from a file descriptor
 void rlb_init(rlb *b, int fd);
-// Reads a line from the descriptor
-size_t rlb_read_line(rlb *b, char *buf, size_t size);
+// Reads whatever is available from the descriptor without blocking
+// Returns false if the connection has been closed or has failed
+bool rlb_fill(rlb *b);
+// Finds the next complete line in the buffered data and terminates it
+// in place without the line break; the line stays valid until rlb_fill()
+// Returns its length, -1 if no complete line has been buffered yet,
+// or -2 if the line was longer than RLB_LINE_MAX and has been dropped
+ssize_t rlb_next_line(rlb *b, char **o_line);
 // Releases the resources used, does not touch the descriptor
 void rlb_deinit(rlb *b);
 
-// Sends a multiline mark, replacing all LF characters with CR-LF diagraphs
+// A buffer of replies waiting to be sent together
+typedef struct reply_buf_s {
+  char *buf;
+  size_t len, cap;
+  char *msg;      // Scratch space for formatting
+  size_t msg_cap;
+} reply_buf;
+
+void reply_init(reply_buf *r);
+void reply_deinit(reply_buf *r);
+// Appends a multiline mark, replacing all LF characters with CR-LF diagraphs
 // The message may or may not be terminated with an LF
-// Either way, the sent mark is terminated with CR-LF
+// Either way, the mark is terminated with CR-LF
+void reply_add(reply_buf *r, int code, const char *msg);
+// The same with a formatted message, which is never truncated
+void reply_addf(reply_buf *r, int code, const char *fmt, ...)
+  __attribute__((format(printf, 3, 4)));
+// Appends data as is
+void reply_raw(reply_buf *r, const char *data, size_t len);
+// Sends buffered replies with a single write, without waiting on a
+// non-blocking `fd`; returns false if some are still left to send
+bool reply_flush(reply_buf *r, int fd);
+
+// Sends a single mark, as reply_add() does
 void send_mark(int fd, int code, const char *msg);
 
 // Creates a new socket and bind it to an ephemeral port.
@@ -0,0 +1,322 @@
+#define _GNU_SOURCE   // getdents64()
+
+#include "listing.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <grp.h>
+#include <limits.h>
+#include <pwd.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#define DENTS_BUFSIZE   32768
+#define OUT_BUFSIZE     65536
+// Longest line rendered: fixed fields, a name, " -> " and a link target
+// of up to PATH_MAX - 1 bytes, CRLF and the terminator
+#define LINE_MAX_LEN    (160 + NAME_MAX + PATH_MAX + 6)
+#define NAME_CACHE_SIZE 8
+
+typedef struct entry_s {
+  char *name;
+  struct stat st;
+} entry;
+
+// Recently resolved user/group names
+typedef struct name_cache_s {
+  unsigned id[NAME_CACHE_SIZE];
+  char name[NAME_CACHE_SIZE][32];
+  int count, next;
+} name_cache;
+
+struct lister_s {
+  int dir_fd;
+  char fmt;
+  bool stream;
+  char *pattern;    // NULL if not filtered
+  bool literal;     // `pattern` is a name, not a pattern
+
+  // All entries, read on the first call and sorted by name,
+  // or the current batch when streaming
+  entry *ents;
+  size_t num_ents, cap_ents, pos;
+  bool read;
+  unsigned long long total_blocks;
+  char *dents;      // getdents64() buffer
+
+  // Column widths, as `ls` aligns numeric and name columns
+  int w_nlink, w_user, w_group, w_size;
+
+  name_cache users, groups;
+  time_t now;
+
+  char *out;    // Reusable output buffer
+};
+
+lister *lister_open(int fd, char fmt, bool stream, const char *pattern,
+  bool literal)
+{
+  lister *l = malloc(sizeof(lister));
+  l->dir_fd = fd;
+  l->fmt = fmt;
+  l->stream = stream;
+  l->pattern = (pattern == NULL ? NULL : strdup(pattern));
+  l->literal = literal;
+  l->ents = NULL;
+  l->num_ents = l->cap_ents = l->pos = 0;
+  l->read = false;
+  l->total_blocks = 0;
+  l->dents = NULL;
+  l->w_nlink = l->w_user = l->w_group = l->w_size = 1;
+  l->users.count = l->users.next = 0;
+  l->groups.count = l->groups.next = 0;
+  l->now = time(NULL);
+  l->out = NULL;
+  return l;
+}
+
+char lister_format(const lister *l)
+{
+  return l->fmt;
+}
+
+static void clear_entries(lister *l)
+{
+  for (size_t i = 0; i < l->num_ents; i++) free(l->ents[i].name);
+  l->num_ents = l->pos = 0;
+}
+
+void lister_close(lister *l)
+{
+  clear_entries(l);
+  free(l->ents);
+  free(l->pattern);
+  free(l->dents);
+  free(l->out);
+  close(l->dir_fd);
+  free(l);
+}
+
+static const char *lookup_name(name_cache *cache, unsigned id, bool is_user)
+{
+  for (int i = 0; i < cache->count; i++)
+    if (cache->id[i] == id) return cache->name[i];
+
+  int i = cache->next;
+  cache->next = (cache->next + 1) % NAME_CACHE_SIZE;
+  if (cache->count < NAME_CACHE_SIZE) cache->count++;
+  cache->id[i] = id;
+
+  char buf[1024];
+  const char *name = NULL;
+  if (is_user) {
+    struct passwd pw, *result;
+    if (getpwuid_r(id, &pw, buf, sizeof buf, &result) == 0 && result != NULL)
+      name = pw.pw_name;
+  } else {
+    struct group gr, *result;
+    if (getgrgid_r(id, &gr, buf, sizeof buf, &result) == 0 && result != NULL)
+      name = gr.gr_name;
+  }
+  if (name != NULL)
+    snprintf(cache->name[i], sizeof cache->name[i], "%s", name);
+  else
+    snprintf(cache->name[i], sizeof cache->name[i], "%u", id);
+  return cache->name[i];
+}
+
+static int num_width(unsigned long long x)
+{
+  int w = 1;
+  while (x >= 10) { x /= 10; w++; }
+  return w;
+}
+
+static int entry_cmp(const void *a, const void *b)
+{
+  return strcmp(((const entry *)a)->name, ((const entry *)b)->name);
+}
+
+// Stats and collects the entries returned by one getdents64() call
+static void collect(lister *l, ssize_t n)
+{
+  for (ssize_t offs = 0; offs < n; ) {
+    struct dirent64 *d = (struct dirent64 *)(l->dents + offs);
+    offs += d->d_reclen;
+    if (l->pattern == NULL) {
+      // Hidden entries are omitted, as by `ls -l`
+      if (d->d_name[0] == '.') continue;
+    } else if (l->literal ? strcmp(l->pattern, d->d_name) != 0 :
+        fnmatch(l->pattern, d->d_name, FNM_PERIOD) != 0) {
+      continue;
+    }
+
+    // Names alone need no stat
+    struct stat st;
+    if (l->fmt != LISTER_NAMES &&
+        fstatat(l->dir_fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+      continue;   // Removed in the meantime
+
+    if (l->num_ents == l->cap_ents) {
+      l->cap_ents = (l->cap_ents == 0 ? 64 : l->cap_ents * 2);
+      l->ents = realloc(l->ents, l->cap_ents * sizeof(entry));
+    }
+    l->ents[l->num_ents].name = strdup(d->d_name);
+    if (l->fmt != LISTER_NAMES) l->ents[l->num_ents].st = st;
+    l->num_ents++;
+
+    // Facts are not aligned and have no total
+    if (l->fmt != LISTER_LONG) continue;
+    l->total_blocks += (st.st_blocks + 1) / 2;
+    int w;
+    if ((w = num_width(st.st_nlink)) > l->w_nlink) l->w_nlink = w;
+    if ((w = num_width(st.st_size)) > l->w_size) l->w_size = w;
+    if ((w = strlen(lookup_name(&l->users, st.st_uid, true))) > l->w_user)
+      l->w_user = w;
+    if ((w = strlen(lookup_name(&l->groups, st.st_gid, false))) > l->w_group)
+      l->w_group = w;
+  }
+}
+
+// Reads and stats all entries
+static int read_all_entries(lister *l)
+{
+  ssize_t n;
+  while ((n = getdents64(l->dir_fd, l->dents, DENTS_BUFSIZE)) > 0)
+    collect(l, n);
+  if (n == -1) return -1;
+
+  qsort(l->ents, l->num_ents, sizeof(entry), entry_cmp);
+  return 0;
+}
+
+// Reads the next batch of entries in directory order, leaving none
+// at the end of the directory
+static int read_batch(lister *l)
+{
+  clear_entries(l);
+  // Columns are only aligned within a batch
+  l->w_nlink = l->w_user = l->w_group = l->w_size = 1;
+
+  // A batch may consist of hidden or filtered out entries only
+  ssize_t n = 0;
+  while (l->num_ents == 0 &&
+      (n = getdents64(l->dir_fd, l->dents, DENTS_BUFSIZE)) > 0)
+    collect(l, n);
+  return (n == -1 ? -1 : 0);
+}
+
+static void mode_string(mode_t m, char s[11])
+{
+  s[0] = S_ISDIR(m) ? 'd' : S_ISLNK(m) ? 'l' : S_ISCHR(m) ? 'c' :
+    S_ISBLK(m) ? 'b' : S_ISFIFO(m) ? 'p' : S_ISSOCK(m) ? 's' : '-';
+  s[1] = (m & S_IRUSR) ? 'r' : '-';
+  s[2] = (m & S_IWUSR) ? 'w' : '-';
+  s[3] = (m & S_ISUID) ? ((m & S_IXUSR) ? 's' : 'S') : ((m & S_IXUSR) ? 'x' : '-');
+  s[4] = (m & S_IRGRP) ? 'r' : '-';
+  s[5] = (m & S_IWGRP) ? 'w' : '-';
+  s[6] = (m & S_ISGID) ? ((m & S_IXGRP) ? 's' : 'S') : ((m & S_IXGRP) ? 'x' : '-');
+  s[7] = (m & S_IROTH) ? 'r' : '-';
+  s[8] = (m & S_IWOTH) ? 'w' : '-';
+  s[9] = (m & S_ISVTX) ? ((m & S_IXOTH) ? 't' : 'T') : ((m & S_IXOTH) ? 'x' : '-');
+  s[10] = '\0';
+}
+
+// Renders one entry, returns the length of the line
+static size_t render(lister *l, const entry *e, char *p)
+{
+  char mode[11];
+  mode_string(e->st.st_mode, mode);
+
+  // Recent files show the time, others (and future ones) show the year
+  char date[16];
+  struct tm tm;
+  time_t t = e->st.st_mtime;
+  localtime_r(&t, &tm);
+  bool recent = (t <= l->now && l->now - t < 15778476);  // Half a year
+  strftime(date, sizeof date, recent ? "%b %e %H:%M" : "%b %e  %Y", &tm);
+
+  int len = sprintf(p, "%s %*lu %-*s %-*s %*lld %s %s",
+    mode,
+    l->w_nlink, (unsigned long)e->st.st_nlink,
+    l->w_user, lookup_name(&l->users, e->st.st_uid, true),
+    l->w_group, lookup_name(&l->groups, e->st.st_gid, false),
+    l->w_size, (long long)e->st.st_size,
+    date, e->name);
+
+  if (S_ISLNK(e->st.st_mode)) {
+    char target[PATH_MAX];
+    ssize_t n = readlinkat(l->dir_fd, e->name, target, sizeof target - 1);
+    if (n > 0) {
+      target[n] = '\0';
+      len += sprintf(p + len, " -> %s", target);
+    }
+  }
+
+  p[len++] = '\r';
+  p[len++] = '\n';
+  return len;
+}
+
+size_t lister_facts(const struct stat *st, const char *name, char *p)
+{
+  mode_t m = st->st_mode;
+  const char *type = S_ISREG(m) ? "file" : S_ISDIR(m) ? "dir" :
+    S_ISLNK(m) ? "OS.unix=symlink" : S_ISCHR(m) ? "OS.unix=chr" :
+    S_ISBLK(m) ? "OS.unix=blk" : S_ISFIFO(m) ? "OS.unix=fifo" :
+    "OS.unix=socket";
+
+  struct tm tm;
+  time_t t = st->st_mtime;
+  gmtime_r(&t, &tm);
+
+  size_t len = sprintf(p, "type=%s;", type);
+  if (!S_ISDIR(m))
+    len += sprintf(p + len, "size=%lld;", (long long)st->st_size);
+  len += strftime(p + len, 32, "modify=%Y%m%d%H%M%S;", &tm);
+  len += sprintf(p + len, "unique=%llxU%llx; %s\r\n",
+    (unsigned long long)st->st_dev, (unsigned long long)st->st_ino, name);
+  return len;
+}
+
+ssize_t lister_next(lister *l, const char **o_data)
+{
+  if (!l->read) {
+    l->read = true;
+    l->dents = malloc(DENTS_BUFSIZE);
+    l->out = malloc(OUT_BUFSIZE);
+
+    // The total is unknown until the end when streaming, and left out;
+    // it is not shown for selected files either, as by `ls -l *.log`
+    if (!l->stream) {
+      if (read_all_entries(l) != 0) return -1;
+      if (l->fmt == LISTER_LONG && l->pattern == NULL) {
+        *o_data = l->out;
+        return sprintf(l->out, "total %llu\r\n", l->total_blocks);
+      }
+    }
+  }
+  if (l->stream && l->pos == l->num_ents && read_batch(l) != 0) return -1;
+
+  size_t len = 0;
+  while (l->pos < l->num_ents && len + LINE_MAX_LEN <= OUT_BUFSIZE) {
+    const entry *e = &l->ents[l->pos++];
+    if (l->fmt == LISTER_LONG)
+      len += render(l, e, l->out + len);
+    else if (l->fmt == LISTER_FACTS)
+      len += lister_facts(&e->st, e->name, l->out + len);
+    else
+      len += sprintf(l->out + len, "%s\r\n", e->name);
+  }
+
+  *o_data = l->out;
+  return len;
+}
@@ -0,0 +1,40 @@
+#ifndef zzftp__listing_h
+#define zzftp__listing_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include <sys/stat.h>
+
+// Renders directory listings in the format of `ls -l`, as RFC 3659 facts
+// or as bare names, reading the directory with getdents64() and fstatat()
+typedef struct lister_s lister;
+
+// Listing formats, also used as keys in the listing cache
+#define LISTER_LONG   'L'   // `ls -l`
+#define LISTER_FACTS  'M'   // MLSD
+#define LISTER_NAMES  'N'   // NLST
+
+// Starts listing a directory, taking over its descriptor
+// Streaming listings are rendered in directory order, one getdents64()
+// batch at a time, with memory use independent of the directory size
+// If a pattern is given, only names matching it are listed, or with
+// `literal`, only the name it is; hidden entries are listed only if the
+// pattern or the name starts with a dot, as by `ls -l .*`
+lister *lister_open(int fd, char fmt, bool stream, const char *pattern,
+  bool literal);
+char lister_format(const lister *l);
+// Renders the next batch of lines into the lister's own buffer
+// Returns the number of bytes, 0 at the end, or -1 on errors
+ssize_t lister_next(lister *l, const char **o_data);
+// Releases the lister and its directory descriptor
+void lister_close(lister *l);
+
+// Longest fact line rendered, excluding the name
+#define LISTER_FACTS_MAX_LEN  128
+// Renders the facts of a file followed by its name and CRLF,
+// as in MLSD and MLST replies; returns the length
+size_t lister_facts(const struct stat *st, const char *name, char *p);
+
+#endif
@@ -0,0 +1,382 @@
+#define _GNU_SOURCE   // O_PATH
+
+#include "lscache.h"
+#include "io_utils.h"
+#include "path_utils.h"
+#include "pool.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/inotify.h>
+
+#define NUM_BUCKETS   1024
+#define MAX_ENTRIES   4096
+
+// Changes in a directory that affect its listing
+#define WATCH_MASK  (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+  IN_ATTRIB | IN_MODIFY | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF)
+
+// A directory with cached listings, indexed by its path and by its watch,
+// which other paths leading to the same directory share
+typedef struct lsdir_s {
+  char *dir;
+  int wd;
+  struct lsent_s *ents;     // One per format
+
+  struct lsdir_s *next;     // Hash chain by path
+  struct lsdir_s *wd_next;  // Hash chain by watch descriptor
+} lsdir;
+
+typedef struct lsent_s {
+  char fmt;
+  lsdir *d;
+  uint64_t ticket;
+  lsblob *blob;     // NULL while being rendered
+  size_t size;      // Accounted size
+
+  struct lsent_s *next;                 // Other formats of the directory
+  struct lsent_s *lru_prev, *lru_next;  // Most recently used first
+} lsent;
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool enabled = false;
+static size_t max_size, tot_size = 0;
+static int num_entries = 0;
+static uint64_t last_ticket = 0;
+
+static lsdir *buckets[NUM_BUCKETS];
+static lsdir *wd_buckets[NUM_BUCKETS];
+static lsent *lru_head = NULL, *lru_tail = NULL;
+
+static int ino_fd = -1;
+
+void lsblob_release(lsblob *b)
+{
+  if (__atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) == 0) free(b);
+}
+
+static lsdir **dir_slot(const char *dir)
+{
+  lsdir **p = &buckets[path_hash(dir) % NUM_BUCKETS];
+  while (*p != NULL && strcmp((*p)->dir, dir) != 0) p = &(*p)->next;
+  return p;
+}
+
+static lsdir **wd_slot(lsdir *d)
+{
+  lsdir **p = &wd_buckets[(unsigned)d->wd % NUM_BUCKETS];
+  while (*p != d) p = &(*p)->wd_next;
+  return p;
+}
+
+static void wd_link(lsdir *d)
+{
+  lsdir **p = &wd_buckets[(unsigned)d->wd % NUM_BUCKETS];
+  d->wd_next = *p;
+  *p = d;
+}
+
+static lsent *find(char fmt, const char *dir)
+{
+  lsdir *d = *dir_slot(dir);
+  if (d == NULL) return NULL;
+  for (lsent *e = d->ents; e != NULL; e = e->next)
+    if (e->fmt == fmt) return e;
+  return NULL;
+}
+
+static void lru_unlink(lsent *e)
+{
+  if (e->lru_prev != NULL) e->lru_prev->lru_next = e->lru_next;
+  else lru_head = e->lru_next;
+  if (e->lru_next != NULL) e->lru_next->lru_prev = e->lru_prev;
+  else lru_tail = e->lru_prev;
+}
+
+static void lru_push(lsent *e)
+{
+  e->lru_prev = NULL;
+  e->lru_next = lru_head;
+  if (lru_head != NULL) lru_head->lru_prev = e;
+  lru_head = e;
+  if (lru_tail == NULL) lru_tail = e;
+}
+
+// Drops a watch once no directory uses it
+static void release_wd(int wd)
+{
+  for (lsdir *d = wd_buckets[(unsigned)wd % NUM_BUCKETS]; d != NULL;
+      d = d->wd_next)
+    if (d->wd == wd) return;
+  inotify_rm_watch(ino_fd, wd);
+}
+
+static void remove_entry(lsent *e)
+{
+  lsdir *d = e->d;
+  lsent **p = &d->ents;
+  while (*p != e) p = &(*p)->next;
+  *p = e->next;
+  lru_unlink(e);
+
+  // The directory goes with its last listing
+  if (d->ents == NULL) {
+    *dir_slot(d->dir) = d->next;
+    *wd_slot(d) = d->wd_next;
+    release_wd(d->wd);
+    tot_size -= sizeof(lsdir) + strlen(d->dir);
+    free(d->dir);
+    free(d);
+  }
+
+  tot_size -= e->size;
+  num_entries--;
+  if (e->blob != NULL) lsblob_release(e->blob);
+  free(e);
+}
+
+static void remove_dir(lsdir *d)
+{
+  while (d->ents->next != NULL) remove_entry(d->ents->next);
+  remove_entry(d->ents);
+}
+
+// Evicts the least recently used entries, but never the most recent one
+static void evict()
+{
+  while (lru_tail != lru_head &&
+      (tot_size > max_size || num_entries > MAX_ENTRIES))
+    remove_entry(lru_tail);
+}
+
+static void remove_wd(int wd)
+{
+  lsdir **p = &wd_buckets[(unsigned)wd % NUM_BUCKETS];
+  while (*p != NULL) {
+    if ((*p)->wd == wd) remove_dir(*p);
+    else p = &(*p)->wd_next;
+  }
+}
+
+static void *watch_loop(void *arg)
+{
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+  while (1) {
+    ssize_t n = read(ino_fd, buf, sizeof buf);
+    if (n <= 0) {
+      if (n == -1 && errno == EINTR) continue;
+      warn("read() from inotify failed");
+      break;
+    }
+
+    pthread_mutex_lock(&mutex);
+    for (ssize_t offs = 0; offs < n; ) {
+      struct inotify_event *ev = (struct inotify_event *)(buf + offs);
+      offs += sizeof(struct inotify_event) + ev->len;
+      if (ev->mask & IN_Q_OVERFLOW) {
+        // Events have been lost, nothing can be trusted
+        while (lru_head != NULL) remove_entry(lru_head);
+      } else if (!(ev->mask & IN_IGNORED)) {
+        remove_wd(ev->wd);
+      }
+    }
+    pthread_mutex_unlock(&mutex);
+  }
+
+  return NULL;
+}
+
+void lscache_init(size_t max_bytes)
+{
+  if (max_bytes == 0) return;
+
+  if ((ino_fd = inotify_init1(IN_CLOEXEC)) == -1) {
+    warn("inotify_init1() failed, listing cache disabled");
+    return;
+  }
+  if (thread_spawn(&watch_loop, NULL) != 0)
+    panic("pthread_create() failed");
+
+  max_size = max_bytes;
+  enabled = true;
+}
+
+lsblob *lscache_get(char fmt, const char *dir)
+{
+  if (!enabled) return NULL;
+
+  lsblob *b = NULL;
+  pthread_mutex_lock(&mutex);
+  lsent *e = find(fmt, dir);
+  if (e != NULL && e->blob != NULL) {
+    b = e->blob;
+    __atomic_add_fetch(&b->refs, 1, __ATOMIC_RELAXED);
+    lru_unlink(e);
+    lru_push(e);
+  }
+  pthread_mutex_unlock(&mutex);
+  return b;
+}
+
+uint64_t lscache_prepare(char fmt, const char *dir)
+{
+  if (!enabled) return 0;
+
+  // The directory is resolved beneath the root as files are, and watched
+  // through the descriptor, so that no symlink leads the watch out of it
+  int fd = path_openat(path_root_fd, dir[1] == '\0' ? "." : dir + 1,
+    O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC, 0);
+  if (fd == -1) return 0;
+  char proc[32];
+  snprintf(proc, sizeof proc, "/proc/self/fd/%d", fd);
+
+  // Watch before rendering, so that no change goes unnoticed
+  // The watch is added under the lock, as an existing one for the same
+  // directory is returned and may otherwise be removed in the meantime
+  pthread_mutex_lock(&mutex);
+  int wd = inotify_add_watch(ino_fd, proc, WATCH_MASK | IN_ONLYDIR);
+  close(fd);
+  if (wd == -1) {
+    pthread_mutex_unlock(&mutex);
+    warn("inotify_add_watch() failed");
+    return 0;
+  }
+
+  lsdir **p = dir_slot(dir), *d = *p;
+  if (d == NULL) {
+    d = malloc(sizeof(lsdir));
+    d->dir = strdup(dir);
+    d->wd = wd;
+    d->ents = NULL;
+    d->next = NULL;
+    *p = d;
+    wd_link(d);
+    tot_size += sizeof(lsdir) + strlen(dir);
+  } else if (d->wd != wd) {
+    // The directory has been replaced since
+    int old_wd = d->wd;
+    *wd_slot(d) = d->wd_next;
+    d->wd = wd;
+    wd_link(d);
+    release_wd(old_wd);
+  }
+
+  lsent *e = d->ents;
+  while (e != NULL && e->fmt != fmt) e = e->next;
+  if (e != NULL) {
+    // Rendered again, possibly concurrently; the last one wins
+    if (e->blob != NULL) {
+      tot_size -= e->blob->len;
+      e->size -= e->blob->len;
+      lsblob_release(e->blob);
+      e->blob = NULL;
+    }
+    e->ticket = ++last_ticket;
+    lru_unlink(e);
+    lru_push(e);
+  } else {
+    e = malloc(sizeof(lsent));
+    e->fmt = fmt;
+    e->d = d;
+    e->ticket = ++last_ticket;
+    e->blob = NULL;
+    e->size = sizeof(lsent);
+
+    e->next = d->ents;
+    d->ents = e;
+    lru_push(e);
+    tot_size += e->size;
+    num_entries++;
+    evict();
+  }
+
+  uint64_t ticket = e->ticket;
+  pthread_mutex_unlock(&mutex);
+  return ticket;
+}
+
+bool lscache_fits(size_t len)
+{
+  return enabled && len <= max_size / 4;
+}
+
+void lscache_put(char fmt, const char *dir, uint64_t ticket,
+  const char *data, size_t len)
+{
+  if (ticket == 0 || !lscache_fits(len)) return;
+
+  lsblob *b = malloc(sizeof(lsblob) + len);
+  b->refs = 1;
+  b->len = len;
+  memcpy(b->data, data, len);
+
+  pthread_mutex_lock(&mutex);
+  lsent *e = find(fmt, dir);
+  if (e != NULL && e->ticket == ticket && e->blob == NULL) {
+    e->blob = b;
+    e->size += len;
+    tot_size += len;
+    b = NULL;
+    evict();
+  }
+  pthread_mutex_unlock(&mutex);
+
+  if (b != NULL) free(b);
+}
+
+static void invalidate(const char *dir, bool tree)
+{
+  if (!enabled) return;
+
+  pthread_mutex_lock(&mutex);
+  lsdir *d = *dir_slot(dir);
+  if (d != NULL) remove_dir(d);
+
+  // Directories below are only found by going through all, which is left
+  // to the removal and renaming of directories
+  size_t len = strlen(dir);
+  for (int i = 0; tree && i < NUM_BUCKETS; i++) {
+    lsdir **p = &buckets[i];
+    while (*p != NULL) {
+      if (strncmp((*p)->dir, dir, len) == 0 &&
+          ((*p)->dir[len] == '/' || len == 1))
+        remove_dir(*p);
+      else
+        p = &(*p)->next;
+    }
+  }
+  pthread_mutex_unlock(&mutex);
+}
+
+void lscache_invalidate(const char *dir)
+{
+  invalidate(dir, false);
+}
+
+void lscache_invalidate_tree(const char *dir)
+{
+  invalidate(dir, true);
+}
+
+void lscache_invalidate_parent(const char *path)
+{
+  if (!enabled) return;
+
+  char dir[PATH_MAX];
+  const char *slash = strrchr(path, '/');
+  size_t len = (slash == NULL || slash == path ? 1 : slash - path);
+  if (len >= sizeof dir) return;
+  memcpy(dir, path, len);
+  dir[len] = '\0';
+  if (slash == NULL) dir[0] = '/';
+  lscache_invalidate(dir);
+}
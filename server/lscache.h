@@ -0,0 +1,43 @@
+#ifndef zzftp__lscache_h
+#define zzftp__lscache_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A rendered listing, shared by the cache and the transfers sending it
+typedef struct lsblob_s {
+  int refs;
+  size_t len;
+  char data[];
+} lsblob;
+
+void lsblob_release(lsblob *b);
+
+// A size-bounded cache of rendered listings keyed by directory and format,
+// invalidated through inotify watches on the cached directories
+// Directories are given relative to the FTP root, starting with a slash
+
+// Enables the cache with a limit on the total size (0 leaves it disabled)
+void lscache_init(size_t max_bytes);
+
+// Looks up a listing, returning a new reference or NULL
+lsblob *lscache_get(char fmt, const char *dir);
+// Starts watching a directory whose listing is about to be rendered
+// Returns a ticket for lscache_put(), or 0 if it cannot be cached
+uint64_t lscache_prepare(char fmt, const char *dir);
+// Stores a listing, unless the directory has changed since the ticket
+// was issued or the listing is too large
+void lscache_put(char fmt, const char *dir, uint64_t ticket,
+  const char *data, size_t len);
+// Whether a listing of the given size would be stored
+bool lscache_fits(size_t len);
+// Drops all listings of a directory
+void lscache_invalidate(const char *dir);
+// Drops all listings of a directory and its subdirectories, whose paths
+// may now refer to other directories
+void lscache_invalidate_tree(const char *dir);
+// Drops all listings of the directory containing `path`
+void lscache_invalidate_parent(const char *path);
+
+#endif
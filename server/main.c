@@ -1,32 +1,149 @@
-#include "io_utils.h"
+#define _GNU_SOURCE   // accept4()
+
 #include "client.h"
+#include "hashcache.h"
+#include "io_utils.h"
+#include "lscache.h"
+#include "path_utils.h"
+#include "pool.h"
+#include "reactor.h"
+#include "sched.h"
+#include "shaper.h"
+#include "statcache.h"
 
-#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <signal.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 
-void *serve_client(void *arg)
+void print_usage(char *argv0, int exit_code)
 {
-  int conn_fd = *(int *)arg;
-  free(arg);
+  printf("usage: %s [-port <n>] [-root <path>] [-reactors <n>]\n"
+         "       [-acceptors <n>] [-stack-size <KiB>] [-data-workers <n>]\n"
+         "       [-hash-workers <n>] [-max-sessions <n>] [-admission-queue <n>]\n"
+         "       [-xfer-buf <bytes>] [-xfer-buf-max <bytes>] [-sock-buf <bytes>]\n"
+         "       [-list-cache <bytes>] [-stat-cache <n>] [-stat-cache-ttl <ms>]\n"
+         "       [-deflate-level <0-9>] [-data-idle-timeout <s>]\n"
+         "       [-hash-cache <file>]\n"
+         "       [-hash-cache-entries <n>] [-rate-down <bytes/s>]\n"
+         "       [-rate-up <bytes/s>] [-user-rate-down <bytes/s>]\n"
+         "       [-user-rate-up <bytes/s>] [-session-rate-down <bytes/s>]\n"
+         "       [-session-rate-up <bytes/s>] [-sched-rate <bytes/s>]\n"
+         "       [-sched-weights <interactive>:<bulk>]\n"
+         "       [-sched-bulk-size <bytes>] [-admin-user <name>]\n",
+    argv0);
+  exit(exit_code);
+}
 
-  client *c = client_create(conn_fd);
-  client_run_loop(c);
-  client_close(c);
-  return NULL;
+// Finds the scope and direction of a rate limit option
+static bool rate_option(const char *opt, shaper_scope *scope, shaper_dir *dir)
+{
+  static const char *opts[SHAPER_SCOPES][SHAPER_DIRS] = {
+    [SHAPER_GLOBAL] = { "-rate-down", "-rate-up" },
+    [SHAPER_USER] = { "-user-rate-down", "-user-rate-up" },
+    [SHAPER_SESSION] = { "-session-rate-down", "-session-rate-up" },
+  };
+  for (int k = 0; k < SHAPER_SCOPES; k++)
+    for (int d = 0; d < SHAPER_DIRS; d++)
+      if (strcmp(opt, opts[k][d]) == 0) {
+        *scope = k;
+        *dir = d;
+        return true;
+      }
+  return false;
 }
 
-void print_usage(char *argv0, int exit_code)
+static int listen_on(int port, bool reuse_port)
 {
-  printf("usage: %s [-port <n>] [-root <path>]\n", argv0);
-  exit(exit_code);
+  // Allocate socket
+  int sock_fd = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+  if (sock_fd == -1)
+    panic("socket() failed");
+
+  // Allow successive runs without waiting
+  if (setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR,
+      &(int){1}, sizeof(int)) == -1)
+    panic("setsockopt() failed");
+  // Allow multiple sockets to share the port
+  if (reuse_port && setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT,
+      &(int){1}, sizeof(int)) == -1)
+    panic("setsockopt() failed");
+
+  // Bind to address and start listening
+  struct sockaddr_in addr = { 0 };
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = INADDR_ANY;
+  if (bind(sock_fd, (struct sockaddr *)&addr, sizeof addr) == -1)
+    panic("bind() failed");
+  if (listen(sock_fd, 1024) == -1)
+    panic("listen() failed");
+
+  return sock_fd;
+}
+
+// Time to wait before accepting again after running out of resources
+#define ACCEPT_BACKOFF_MS   50
+
+static void *accept_loop(void *arg)
+{
+  int sock_fd = *(int *)arg;
+  // Held in reserve, to turn a connection away when out of descriptors
+  int spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+  // Accept connections
+  struct sockaddr_in cli_addr;
+  socklen_t cli_addr_len;
+  while (1) {
+    cli_addr_len = sizeof cli_addr;
+    int conn_fd = accept4(sock_fd, (struct sockaddr *)&cli_addr, &cli_addr_len,
+      SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (conn_fd == -1) {
+      switch (errno) {
+      case EINTR:
+      case ECONNABORTED:  // Reset before being accepted
+      // Network errors of the pending connection, passed on by Linux
+      case ENETDOWN: case EPROTO: case ENOPROTOOPT: case EHOSTDOWN:
+      case ENONET: case EHOSTUNREACH: case EOPNOTSUPP: case ENETUNREACH:
+      case EPERM:         // Denied by the firewall
+        continue;
+      case EMFILE:
+      case ENFILE:
+        // The connection is closed right away rather than left to be
+        // retried in a busy loop, and the reserve taken back
+        warn("accept4() failed, out of descriptors");
+        if (spare_fd != -1) {
+          close(spare_fd);
+          int fd = accept4(sock_fd, NULL, NULL, SOCK_CLOEXEC);
+          if (fd != -1) close(fd);
+          spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+          if (fd != -1) continue;
+        }
+        // Fall through
+      case ENOBUFS:
+      case ENOMEM:
+        warn("accept4() failed, backing off");
+        nanosleep(&(struct timespec){ .tv_nsec = ACCEPT_BACKOFF_MS * 1000000 },
+          NULL);
+        continue;
+      default:
+        panic("accept4() failed");
+      }
+    }
+
+    reactor_add(conn_fd);
+  }
+
+  return NULL;
 }
 
 int main(int argc, char *argv[])
@@ -34,6 +151,26 @@ int main(int argc, char *argv[])
   // Parse arguments
   int port = 21;
   const char *root = "/tmp";
+  int num_reactors = sysconf(_SC_NPROCESSORS_ONLN);
+  int num_acceptors = 1;
+  int stack_kib = 256;
+  int num_data_workers = 64;
+  int num_hash_workers = 4;
+  int max_sessions = 0;
+  size_t list_cache = 16 << 20;
+  size_t stat_cache = 8192;
+  int stat_cache_ttl = 2000;
+  const char *hash_cache = NULL;
+  size_t hash_cache_entries = 65536;
+  int admission_queue = 256;
+  shaper_scope scope;
+  shaper_dir dir;
+  unsigned long long sched_rate = 0;
+  int sched_weights[SCHED_CLASSES] = {
+    [SCHED_INTERACTIVE] = 4,
+    [SCHED_BULK] = 1,
+  };
+  unsigned long long sched_bulk_size = 16 << 20;
 
   for (int i = 1; i < argc; i++) {
     if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "-help") == 0) {
@@ -46,54 +183,150 @@ int main(int argc, char *argv[])
     } else if (strcmp(argv[i], "-root") == 0) {
       if (++i >= argc) print_usage(argv[0], 1);
       root = argv[i];
+    } else if (strcmp(argv[i], "-reactors") == 0) {
+      if (++i >= argc) print_usage(argv[0], 1);
+      if (sscanf(argv[i], "%d", &num_reactors) != 1 || num_reactors <= 0)
+        print_usage(argv[0], 1);
+    } else if (strcmp(argv[i], "-acceptors") == 0) {
+      if (++i >= argc) print_usage(argv[0], 1);
+      if (sscanf(argv[i], "%d", &num_acceptors) != 1 || num_acceptors < 0)
+        print_usage(argv[0], 1);
+      // 0 stands for one per core
+      if (num_acceptors == 0) num_acceptors = sysconf(_SC_NPROCESSORS_ONLN);
+    } else if (strcmp(argv[i], "-stack-size") == 0) {
+      if (++i >= argc) print_usage(argv[0], 1);
+      if (sscanf(argv[i], "%d", &stack_kib) != 1 || stack_kib < 0)
+        print_usage(argv[0], 1);
+    } else if (strcmp(argv[i], "-data-workers") == 0) {
+      if (++i >= argc) print_usage(argv[0], 1);
+      if (sscanf(argv[i], "%d", &num_data_workers) != 1 ||
+          num_data_workers <= 0)
+        print_usage(argv[0], 1);
+    } else if (strcmp(argv[i], "-hash-workers") == 0) {
+      if (++i >= argc) print_usage(argv[0], 1);
+      if (sscanf(argv[i], "%d", &num_hash_workers) != 1 ||
+          num_hash_workers <= 0)
+        print_usage(argv[0], 1);
+    } else if (strcmp(argv[i], "-max-sessions") == 0) {
+      if (++i >= argc) print_usage(argv[0], 1);
+      if (sscanf(argv[i], "%d", &max_sessions) != 1 || max_sessions < 0)
+        print_usage(argv[0], 1);
+    } else if (strcmp(argv[i], "-admission-queue") == 0) {
+      if (++i >= argc) print_usage(argv[0], 1);
+      if (sscanf(argv[i], "%d", &admission_queue) != 1 ||
+          admission_queue < 0)
+        print_usage(argv[0], 1);
+    } else if (strcmp(argv[i], "-xfer-buf") == 0) {
+      if (++i >= argc) print_usage(argv[0], 1);
+      if (sscanf(argv[i], "%zu", &client_xfer_opts.buf_min) != 1 ||
+          client_xfer_opts.buf_min == 0)
+        print_usage(argv[0], 1);
+    } else if (strcmp(argv[i], "-xfer-buf-max") == 0) {
+      if (++i >= argc) print_usage(argv[0], 1);
+      if (sscanf(argv[i], "%zu", &client_xfer_opts.buf_max) != 1)
+        print_usage(argv[0], 1);
+    } else if (strcmp(argv[i], "-sock-buf") == 0) {
+      if (++i >= argc) print_usage(argv[0], 1);
+      if (sscanf(argv[i], "%d", &client_xfer_opts.sock_buf) != 1 ||
+          client_xfer_opts.sock_buf < 0)
+        print_usage(argv[0], 1);
+    } else if (strcmp(argv[i], "-deflate-level") == 0) {
+      if (++i >= argc) print_usage(argv[0], 1);
+      if (sscanf(argv[i], "%d", &client_xfer_opts.deflate_level) != 1 ||
+          client_xfer_opts.deflate_level < 0 ||
+          client_xfer_opts.deflate_level > 9)
+        print_usage(argv[0], 1);
+    } else if (strcmp(argv[i], "-data-idle-timeout") == 0) {
+      if (++i >= argc) print_usage(argv[0], 1);
+      if (sscanf(argv[i], "%d", &client_xfer_opts.idle_timeout) != 1 ||
+          client_xfer_opts.idle_timeout < 0)
+        print_usage(argv[0], 1);
+    } else if (strcmp(argv[i], "-hash-cache") == 0) {
+      if (++i >= argc) print_usage(argv[0], 1);
+      hash_cache = argv[i];
+    } else if (strcmp(argv[i], "-hash-cache-entries") == 0) {
+      if (++i >= argc) print_usage(argv[0], 1);
+      if (sscanf(argv[i], "%zu", &hash_cache_entries) != 1)
+        print_usage(argv[0], 1);
+    } else if (rate_option(argv[i], &scope, &dir)) {
+      if (++i >= argc) print_usage(argv[0], 1);
+      unsigned long long rate;
+      if (sscanf(argv[i], "%llu", &rate) != 1) print_usage(argv[0], 1);
+      shaper_set_rate(scope, dir, rate);
+    } else if (strcmp(argv[i], "-admin-user") == 0) {
+      if (++i >= argc) print_usage(argv[0], 1);
+      client_admin_user = argv[i];
+    } else if (strcmp(argv[i], "-sched-rate") == 0) {
+      if (++i >= argc) print_usage(argv[0], 1);
+      if (sscanf(argv[i], "%llu", &sched_rate) != 1)
+        print_usage(argv[0], 1);
+    } else if (strcmp(argv[i], "-sched-weights") == 0) {
+      if (++i >= argc) print_usage(argv[0], 1);
+      if (sscanf(argv[i], "%d:%d", &sched_weights[SCHED_INTERACTIVE],
+            &sched_weights[SCHED_BULK]) != 2 ||
+          sched_weights[SCHED_INTERACTIVE] <= 0 ||
+          sched_weights[SCHED_BULK] <= 0)
+        print_usage(argv[0], 1);
+    } else if (strcmp(argv[i], "-sched-bulk-size") == 0) {
+      if (++i >= argc) print_usage(argv[0], 1);
+      if (sscanf(argv[i], "%llu", &sched_bulk_size) != 1)
+        print_usage(argv[0], 1);
+    } else if (strcmp(argv[i], "-list-cache") == 0) {
+      if (++i >= argc) print_usage(argv[0], 1);
+      if (sscanf(argv[i], "%zu", &list_cache) != 1)
+        print_usage(argv[0], 1);
+    } else if (strcmp(argv[i], "-stat-cache") == 0) {
+      if (++i >= argc) print_usage(argv[0], 1);
+      if (sscanf(argv[i], "%zu", &stat_cache) != 1)
+        print_usage(argv[0], 1);
+    } else if (strcmp(argv[i], "-stat-cache-ttl") == 0) {
+      if (++i >= argc) print_usage(argv[0], 1);
+      if (sscanf(argv[i], "%d", &stat_cache_ttl) != 1 || stat_cache_ttl < 0)
+        print_usage(argv[0], 1);
     }
   }
 
+  // Relative to the working directory the server is started in; without
+  // a file, digests are still kept in memory
+  hashcache_init(hash_cache, hash_cache_entries);
+
   if (chdir(root) != 0)
     panic("chdir() failed");
+  path_set_root();
 
   signal(SIGPIPE, SIG_IGN);
 
-  // Allocate socket
-  int sock_fd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
-  if (sock_fd == -1)
-    panic("socket() failed");
+  if (num_reactors <= 0) num_reactors = 1;
+  if (num_acceptors <= 0) num_acceptors = 1;
+  // A maximum below the minimum gives a fixed size
+  if (client_xfer_opts.buf_max < client_xfer_opts.buf_min)
+    client_xfer_opts.buf_max = client_xfer_opts.buf_min;
 
-  // Allow successive runs without waiting
-  if (setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR,
-      &(int){1}, sizeof(int)) == -1)
-    panic("setsockopt() failed");
+  // 0 keeps the system default
+  thread_stack_size((size_t)stack_kib * 1024);
+  // Data jobs wait in the queue while all workers are busy
+  client_data_pool = pool_create(num_data_workers, num_data_workers * 4);
+  client_hash_pool = pool_create(num_hash_workers, num_hash_workers * 16);
+  // 0 leaves downloads unscheduled
+  sched_init(sched_rate, sched_weights, sched_bulk_size);
+  process_init();
+  reactor_admission(max_sessions, admission_queue);
+  // 0 disables caching of listings
+  lscache_init(list_cache);
+  // Changes made outside the server show after the lifetime at most
+  statcache_init(stat_cache, stat_cache_ttl);
+  reactor_start(num_reactors);
 
-  // Bind to address and start listening
-  struct sockaddr_in addr = { 0 };
-  addr.sin_family = AF_INET;
-  addr.sin_port = htons(port);
-  addr.sin_addr.s_addr = INADDR_ANY;
-  if (bind(sock_fd, (struct sockaddr *)&addr, sizeof addr) == -1)
-    panic("bind() failed");
-  if (listen(sock_fd, 1024) == -1)
-    panic("listen() failed");
+  // Open one listening socket per acceptor; the kernel distributes
+  // incoming connections among them when SO_REUSEPORT is set
+  int *sock_fds = malloc(num_acceptors * sizeof(int));
+  for (int i = 0; i < num_acceptors; i++)
+    sock_fds[i] = listen_on(port, num_acceptors > 1);
 
-  // Accept connections
-  struct sockaddr_in cli_addr;
-  socklen_t cli_addr_len;
-  while (1) {
-    cli_addr_len = sizeof cli_addr;
-    int conn_fd = accept(sock_fd, (struct sockaddr *)&cli_addr, &cli_addr_len);
-    if (conn_fd == -1)
-      panic("accept() failed");
-
-    pthread_t thr;
-    int *conn_fd_container = malloc(sizeof(int));
-    *conn_fd_container = conn_fd;
-    if (pthread_create(&thr, NULL, &serve_client, conn_fd_container) != 0) {
-      warn("cannot serve more clients");
-      close(conn_fd);
-      free(conn_fd_container);
-      continue;
-    }
-    pthread_detach(thr);
-  }
+  for (int i = 1; i < num_acceptors; i++)
+    if (thread_spawn(&accept_loop, &sock_fds[i]) != 0)
+      panic("pthread_create() failed");
+  accept_loop(&sock_fds[0]);
 
   return 0;
 }
@@ -1,30 +1,45 @@
+#define _GNU_SOURCE   // O_PATH
+
 #include "path_utils.h"
+#include "statcache.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include <linux/openat2.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 
-char *path_cat(const char *wd, const char *rel)
+// Characters allowed in path components
+static const bool valid_char[256] = {
+  ['0' ... '9'] = true,
+  ['A' ... 'Z'] = true,
+  ['a' ... 'z'] = true,
+  ['-'] = true, ['.'] = true, ['_'] = true,
+};
+
+size_t path_cat_buf(const char *wd, const char *rel, char *buf, size_t size)
 {
-  if (wd[0] != '/') return NULL;
-  // +2 for the slash and the terminating NUL
-  char *buf = malloc(strlen(wd) + strlen(rel) + 2);
-  if (buf == NULL) return NULL;
-#define meh (free(buf), NULL)
+  if (wd[0] != '/') return 0;
 
-  strcpy(buf, (rel[0] == '/' || rel[0] == '\0') ? "/" : wd);
-  size_t len = strlen(buf);
+  size_t len;
+  if (rel[0] == '/' || rel[0] == '\0') {
+    buf[0] = '/';
+    len = 1;
+  } else {
+    len = strlen(wd);
+    if (len >= size) return 0;
+    memcpy(buf, wd, len);
+  }
 
   for (const char *c = rel, *d = c; *d != '\0'; c = d + 1) {
     // Find the current item
     d = c;
     while (*d != '/' && *d != '\0') {
-      if (!((*d >= '0' && *d <= '9') ||
-          (*d >= 'A' && *d <= 'Z') ||
-          (*d >= 'a' && *d <= 'z') ||
-          (*d == '-' || *d == '.' || *d == '_')))
-        return meh;
+      if (!valid_char[(unsigned char)*d]) return 0;
       d++;
     }
     // Process
@@ -35,14 +50,29 @@ char *path_cat(const char *wd, const char *rel)
       while (buf[len - 1] != '/') len--;
       if (len > 1) len--; // Remove the extra trailing slash
     } else {
+      // +2 for the slash and the terminating NUL
+      if (len + (d - c) + 2 > size) return 0;
       if (len > 1) buf[len++] = '/';
-      for (; c < d; c++) buf[len++] = *c;
+      memcpy(buf + len, c, d - c);
+      len += d - c;
     }
   }
 
   buf[len] = '\0';
+  return len;
+}
+
+char *path_cat(const char *wd, const char *rel)
+{
+  // +2 for the slash and the terminating NUL
+  size_t size = strlen(wd) + strlen(rel) + 2;
+  char *buf = malloc(size);
+  if (buf == NULL) return NULL;
+  if (path_cat_buf(wd, rel, buf, size) == 0) {
+    free(buf);
+    return NULL;
+  }
   return buf;
-#undef meh
 }
 
 bool path_change(char **wd, const char *rel)
@@ -57,13 +87,52 @@ bool path_change(char **wd, const char *rel)
   }
 }
 
+int path_root_fd = AT_FDCWD;
+
+void path_set_root()
+{
+  path_root_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+}
+
+int path_openat(int dir_fd, const char *rel, int flags, mode_t mode)
+{
+  static bool no_openat2 = false;
+
+  if (!__atomic_load_n(&no_openat2, __ATOMIC_RELAXED)) {
+    struct open_how how = {
+      .flags = flags,
+      .mode = ((flags & O_CREAT) ? mode : 0),
+      .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS,
+    };
+    int fd = syscall(SYS_openat2, dir_fd, rel, &how, sizeof how);
+    if (fd != -1 || errno != ENOSYS) return fd;
+    __atomic_store_n(&no_openat2, true, __ATOMIC_RELAXED);
+  }
+  return openat(dir_fd, rel, flags, mode);
+}
+
+int path_lstat(int dir_fd, const char *rel, struct stat *st)
+{
+  int fd = path_openat(dir_fd, rel, O_PATH | O_NOFOLLOW | O_CLOEXEC, 0);
+  if (fd == -1) return -1;
+  int ret = fstat(fd, st);
+  close(fd);
+  return ret;
+}
+
+uint32_t path_hash(const char *path)
+{
+  uint32_t h = 2166136261u;
+  for (; *path != '\0'; path++) h = (h ^ (unsigned char)*path) * 16777619u;
+  return h;
+}
+
 bool path_exists(const char *path, enum path_requirement r)
 {
-  path++; // Skip the leading slash
-  if (*path == '\0') return true;
+  if (path[1] == '\0') return true;
 
   struct stat s;
-  if (lstat(path, &s) != 0) return false;
+  if (statcache_lstat(path, &s) != 0) return false;
   switch (r) {
     case PATH_REQUIREMENT_NONE: return true;
     case PATH_REQUIREMENT_DIR: return S_ISDIR(s.st_mode);
@@ -73,6 +142,7 @@ bool path_exists(const char *path, enum path_requirement r)
 }
 
 #ifdef PATH_UTILS_TEST
+// Build with statcache.c and io_utils.c
 #include <stdio.h>
 #include <string.h>
 
@@ -80,7 +150,8 @@ static void test(const char *a, const char *b, const char *o)
 {
   char *v = path_cat(a, b);
   printf("%s | %s + %s -> %s\n",
-    strcmp(v, o) == 0 ? "passed" : "failed", a, b, v);
+    (v == NULL || o == NULL ? v == o : strcmp(v, o) == 0) ?
+      "passed" : "failed", a, b, v == NULL ? "(invalid)" : v);
   free(v);
 }
 
@@ -98,6 +169,14 @@ int main()
   test("/quq/qvq", "/qwq/qxq/..", "/qwq");
   test("/quq/qvq", "//qwq/qxq/..", "/qwq");
   test("/quq", "qvq/.//.../././///./qwq", "/quq/qvq/.../qwq");
+  test("/quq", "q v q", NULL);
+  test("/quq", "../../qvq*", NULL);
+
+  char buf[8];
+  printf("%s | path_cat_buf() with a short buffer\n",
+    path_cat_buf("/quq", "qvq/qwq", buf, sizeof buf) == 0 &&
+    path_cat_buf("/quq", "qv/..", buf, sizeof buf) == 4 &&
+    strcmp(buf, "/quq") == 0 ? "passed" : "failed");
   return 0;
 }
 #endif
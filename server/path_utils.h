@@ -2,10 +2,16 @@
 #define zzftp__path_utils_h
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
 
 // Calculates the real path from a working directory and a relative path
 // Returns NULL on invalid input
 char *path_cat(const char *wd, const char *rel);
+// The same, but into a buffer of the given size, without allocating
+// Returns the length, or 0 on invalid input or if the buffer is too small
+size_t path_cat_buf(const char *wd, const char *rel, char *buf, size_t size);
 
 // The same, but in-place
 // If successful, true is returned and the original string is freed
@@ -22,4 +28,19 @@ enum path_requirement {
 };
 bool path_exists(const char *path, enum path_requirement r);
 
+// The FTP root directory, opened by path_set_root() in the current
+// directory; AT_FDCWD until then
+extern int path_root_fd;
+void path_set_root();
+
+// Same as openat(), but the path is resolved beneath the directory
+// (openat2() with RESOLVE_BENEATH), so that neither `..` nor symlinks
+// lead out of it; plain openat() is used on kernels without openat2()
+int path_openat(int dir_fd, const char *rel, int flags, mode_t mode);
+// Same as fstatat() with AT_SYMLINK_NOFOLLOW, resolved as above
+int path_lstat(int dir_fd, const char *rel, struct stat *st);
+
+// FNV-1a hash of a path, for the caches keyed by path
+uint32_t path_hash(const char *path);
+
 #endif
@@ -0,0 +1,106 @@
+#include "pool.h"
+#include "io_utils.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+static size_t stack_size = 0;
+
+void thread_stack_size(size_t size)
+{
+  stack_size = size;
+}
+
+int thread_spawn(void *(*fn)(void *), void *arg)
+{
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (stack_size != 0) pthread_attr_setstacksize(&attr, stack_size);
+
+  pthread_t thr;
+  int result = pthread_create(&thr, &attr, fn, arg);
+  pthread_attr_destroy(&attr);
+  return result;
+}
+
+typedef struct pool_job_s {
+  pool_fn fn;
+  void *arg;
+} pool_job;
+
+struct pool_s {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+
+  // Ring buffer of queued jobs
+  pool_job *queue;
+  int queue_size, head, count;
+};
+
+static void *worker(void *arg)
+{
+  pool *p = (pool *)arg;
+
+  while (1) {
+    pthread_mutex_lock(&p->mutex);
+    while (p->count == 0) pthread_cond_wait(&p->cond, &p->mutex);
+    pool_job job = p->queue[p->head];
+    p->head = (p->head + 1) % p->queue_size;
+    p->count--;
+    pthread_mutex_unlock(&p->mutex);
+
+    job.fn(job.arg);
+  }
+
+  return NULL;
+}
+
+pool *pool_create(int num_workers, int queue_size)
+{
+  pool *p = malloc(sizeof(pool));
+  pthread_mutex_init(&p->mutex, NULL);
+  pthread_cond_init(&p->cond, NULL);
+  p->queue = malloc(queue_size * sizeof(pool_job));
+  p->queue_size = queue_size;
+  p->head = p->count = 0;
+
+  for (int i = 0; i < num_workers; i++)
+    if (thread_spawn(&worker, p) != 0)
+      panic("pthread_create() failed");
+
+  return p;
+}
+
+bool pool_submit(pool *p, pool_fn fn, void *arg)
+{
+  pthread_mutex_lock(&p->mutex);
+  bool accepted = (p->count < p->queue_size);
+  if (accepted) {
+    pool_job *job = &p->queue[(p->head + p->count) % p->queue_size];
+    job->fn = fn;
+    job->arg = arg;
+    p->count++;
+    pthread_cond_signal(&p->cond);
+  }
+  pthread_mutex_unlock(&p->mutex);
+  return accepted;
+}
+
+pool_fn pool_cancel(pool *p, void *arg)
+{
+  pool_fn fn = NULL;
+  pthread_mutex_lock(&p->mutex);
+  for (int i = 0; i < p->count; i++) {
+    if (p->queue[(p->head + i) % p->queue_size].arg != arg) continue;
+    fn = p->queue[(p->head + i) % p->queue_size].fn;
+    // Shift the remaining jobs forward
+    for (; i < p->count - 1; i++)
+      p->queue[(p->head + i) % p->queue_size] =
+        p->queue[(p->head + i + 1) % p->queue_size];
+    p->count--;
+    break;
+  }
+  pthread_mutex_unlock(&p->mutex);
+  return fn;
+}
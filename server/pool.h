@@ -0,0 +1,25 @@
+#ifndef zzftp__pool_h
+#define zzftp__pool_h
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Sets the stack size of all threads created by the server
+// 0 keeps the system default
+void thread_stack_size(size_t size);
+// Creates a detached thread with the configured stack size
+// Returns 0 on success and an error number otherwise
+int thread_spawn(void *(*fn)(void *), void *arg);
+
+// A fixed set of pre-spawned worker threads consuming a bounded job queue
+typedef struct pool_s pool;
+typedef void *(*pool_fn)(void *);
+
+pool *pool_create(int num_workers, int queue_size);
+// Queues a job, returns false if the queue is full
+bool pool_submit(pool *p, pool_fn fn, void *arg);
+// Removes a queued job that has not started yet
+// Returns its function, or NULL if no such job is queued
+pool_fn pool_cancel(pool *p, void *arg);
+
+#endif
@@ -0,0 +1,264 @@
+#include "reactor.h"
+#include "client.h"
+#include "io_utils.h"
+#include "pool.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+
+#define MAX_EVENTS  64
+// Set in the event data of passive mode sockets, apart from the session
+#define PASV_TAG    1
+
+typedef struct reactor_s {
+  int epfd;
+  client *deferred;   // Deferred sessions, sorted by `resume_at`
+  // Sessions with a data connection left without a transfer, in the order
+  // they are closed, as all are given the same time
+  client *idle_head, *idle_tail;
+} reactor;
+
+static reactor *reactors;
+static int num_reactors;
+static unsigned next_reactor = 0;
+
+// Admission control
+static pthread_mutex_t adm_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int max_sessions = 0, num_sessions = 0;
+static int *pending;    // Ring buffer of connections waiting for admission
+static int pending_size = 0, pending_head = 0, pending_count = 0;
+
+static void admit(int sock_ctl);
+
+// Watched for writability at first, to send the replies the session has
+// left over, if any
+static void watch(reactor *r, client *c)
+{
+  struct epoll_event ev = { 0 };
+  ev.events = EPOLLIN | EPOLLRDHUP | EPOLLOUT;
+  ev.data.ptr = c;
+  if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, c->sock_ctl, &ev) == -1)
+    panic("epoll_ctl() failed");
+}
+
+// Sessions are woken up by asking for EPOLLOUT, which the control
+// connection reports right away as long as it has room for replies
+void reactor_wake(client *c)
+{
+  struct epoll_event ev = { 0 };
+  ev.events = EPOLLIN | EPOLLRDHUP | EPOLLOUT;
+  ev.data.ptr = c;
+  // Fails for a deferred session, which processes the queue on resumption
+  epoll_ctl(c->rct->epfd, EPOLL_CTL_MOD, c->sock_ctl, &ev);
+}
+
+// Only the first connection is accepted by the session; more are left to
+// the data job, if the client makes any
+void reactor_watch_pasv(client *c)
+{
+  struct epoll_event ev = { 0 };
+  ev.events = EPOLLIN | EPOLLONESHOT;
+  ev.data.u64 = (uintptr_t)c | PASV_TAG;
+  if (epoll_ctl(c->rct->epfd, EPOLL_CTL_MOD, c->sock_pasv, &ev) == -1 &&
+      epoll_ctl(c->rct->epfd, EPOLL_CTL_ADD, c->sock_pasv, &ev) == -1)
+    warn("epoll_ctl() failed");
+}
+
+static void unwatch(reactor *r, client *c)
+{
+  epoll_ctl(r->epfd, EPOLL_CTL_DEL, c->sock_ctl, NULL);
+}
+
+static void idle_unlink(reactor *r, client *c)
+{
+  if (c->rct_idle_at == 0) return;
+  *(c->rct_idle_prev != NULL ? &c->rct_idle_prev->rct_idle_next :
+    &r->idle_head) = c->rct_idle_next;
+  *(c->rct_idle_next != NULL ? &c->rct_idle_next->rct_idle_prev :
+    &r->idle_tail) = c->rct_idle_prev;
+  c->rct_idle_prev = c->rct_idle_next = NULL;
+  c->rct_idle_at = 0;
+}
+
+// Lists the session under the time its data connection is closed, which
+// only ever moves later, or takes it off the list
+static void idle_update(reactor *r, client *c)
+{
+  uint64_t at = client_idle_at(c);
+  if (at == c->rct_idle_at) return;
+  idle_unlink(r, c);
+  if (at == 0) return;
+  c->rct_idle_at = at;
+  c->rct_idle_prev = r->idle_tail;
+  *(r->idle_tail != NULL ? &r->idle_tail->rct_idle_next : &r->idle_head) = c;
+  r->idle_tail = c;
+}
+
+static void handle_status(reactor *r, client *c, client_status st)
+{
+  if (st != CLIENT_CLOSED) idle_update(r, c);
+
+  if (st == CLIENT_CLOSED) {
+    unwatch(r, c);
+    idle_unlink(r, c);
+    client_close(c);
+
+    // Hand the slot over to a pending connection
+    int next = -1;
+    pthread_mutex_lock(&adm_mutex);
+    if (pending_count > 0) {
+      next = pending[pending_head];
+      pending_head = (pending_head + 1) % pending_size;
+      pending_count--;
+    } else {
+      num_sessions--;
+    }
+    pthread_mutex_unlock(&adm_mutex);
+    if (next != -1) admit(next);
+  } else if (st == CLIENT_BLOCKED) {
+    // Stop reading until the replies are sent
+    struct epoll_event ev = { 0 };
+    ev.events = EPOLLOUT | EPOLLRDHUP;
+    ev.data.ptr = c;
+    epoll_ctl(r->epfd, EPOLL_CTL_MOD, c->sock_ctl, &ev);
+  } else if (st == CLIENT_DEFERRED) {
+    // Stop reading until the deferred reply is sent
+    unwatch(r, c);
+    client **p = &r->deferred;
+    while (*p != NULL && (*p)->resume_at <= c->resume_at) p = &(*p)->rct_next;
+    c->rct_next = *p;
+    *p = c;
+  }
+}
+
+static void *reactor_loop(void *arg)
+{
+  reactor *r = (reactor *)arg;
+  struct epoll_event evs[MAX_EVENTS];
+
+  while (1) {
+    uint64_t wake_at = 0;
+    if (r->deferred != NULL) wake_at = r->deferred->resume_at;
+    if (r->idle_head != NULL &&
+        (wake_at == 0 || r->idle_head->rct_idle_at < wake_at))
+      wake_at = r->idle_head->rct_idle_at;
+    int timeout = -1;
+    if (wake_at != 0) {
+      uint64_t now = monotonic_ms();
+      timeout = (wake_at > now ? wake_at - now : 0);
+    }
+
+    int n = epoll_wait(r->epfd, evs, MAX_EVENTS, timeout);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      panic("epoll_wait() failed");
+    }
+
+    for (int i = 0; i < n; i++) {
+      uint64_t data = evs[i].data.u64;
+      if (data == 0) continue;
+      if (data & PASV_TAG) {
+        client_on_pasv((client *)(uintptr_t)(data & ~(uint64_t)PASV_TAG));
+        continue;
+      }
+
+      client *c = (client *)evs[i].data.ptr;
+      if (evs[i].events & EPOLLOUT) {
+        // Woken up, stop watching for writability
+        struct epoll_event ev = { 0 };
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.ptr = c;
+        epoll_ctl(r->epfd, EPOLL_CTL_MOD, c->sock_ctl, &ev);
+      }
+      client_status st = client_on_readable(c);
+      // Drop an event of its passive mode socket later in the batch
+      if (st == CLIENT_CLOSED)
+        for (int j = i + 1; j < n; j++)
+          if (evs[j].data.u64 == ((uintptr_t)c | PASV_TAG))
+            evs[j].data.u64 = 0;
+      handle_status(r, c, st);
+    }
+
+    // Resume deferred sessions that are due
+    uint64_t now = monotonic_ms();
+    while (r->deferred != NULL && r->deferred->resume_at <= now) {
+      client *c = r->deferred;
+      r->deferred = c->rct_next;
+      c->rct_next = NULL;
+      watch(r, c);
+      handle_status(r, c, client_resume(c));
+    }
+
+    // Close data connections left without a transfer for too long
+    while (r->idle_head != NULL && r->idle_head->rct_idle_at <= now) {
+      client *c = r->idle_head;
+      idle_unlink(r, c);
+      client_idle_expire(c, now);
+      idle_update(r, c);
+    }
+  }
+
+  return NULL;
+}
+
+void reactor_start(int n)
+{
+  num_reactors = n;
+  reactors = malloc(n * sizeof(reactor));
+
+  for (int i = 0; i < n; i++) {
+    reactor *r = &reactors[i];
+    r->deferred = NULL;
+    r->idle_head = r->idle_tail = NULL;
+    if ((r->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+      panic("epoll_create1() failed");
+    if (thread_spawn(&reactor_loop, r) != 0)
+      panic("pthread_create() failed");
+  }
+}
+
+void reactor_admission(int max, int queue_size)
+{
+  max_sessions = max;
+  pending_size = queue_size;
+  pending = malloc((queue_size > 0 ? queue_size : 1) * sizeof(int));
+}
+
+void reactor_add(int sock_ctl)
+{
+  pthread_mutex_lock(&adm_mutex);
+  bool admitted = false, queued = false;
+  if (max_sessions == 0 || num_sessions < max_sessions) {
+    num_sessions++;
+    admitted = true;
+  } else if (pending_count < pending_size) {
+    pending[(pending_head + pending_count) % pending_size] = sock_ctl;
+    pending_count++;
+    queued = true;
+  }
+  pthread_mutex_unlock(&adm_mutex);
+
+  if (admitted) {
+    admit(sock_ctl);
+  } else if (!queued) {
+    send_mark(sock_ctl, 421, "Too many connections, try again later.");
+    close(sock_ctl);
+  }
+}
+
+static void admit(int sock_ctl)
+{
+  client *c = client_create(sock_ctl);
+  unsigned i = __atomic_fetch_add(&next_reactor, 1, __ATOMIC_RELAXED);
+  c->rct = &reactors[i % num_reactors];
+
+  // Greeted before its commands can be read; what the greeting leaves
+  // unsent is sent once watched
+  client_greet(c);
+  watch(c->rct, c);
+}
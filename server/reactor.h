@@ -0,0 +1,25 @@
+#ifndef zzftp__reactor_h
+#define zzftp__reactor_h
+
+// Starts `n` reactor threads, each multiplexing a share of
+// the control connections through its own epoll instance
+void reactor_start(int n);
+
+// Limits the number of concurrent sessions (0 for no limit)
+// Connections beyond the limit wait in a queue of `queue_size`
+// before being greeted, and are turned away when the queue is full
+void reactor_admission(int max_sessions, int queue_size);
+
+// Creates a session for a newly accepted, non-blocking control connection and
+// hands it over to one of the reactors
+void reactor_add(int sock_ctl);
+
+struct client_s;
+// Makes the session's reactor process its buffered and queued commands,
+// to be called from other threads once a transfer has completed
+void reactor_wake(struct client_s *c);
+// Watches the session's passive mode socket once, for the session to accept
+// the connection while no data job runs
+void reactor_watch_pasv(struct client_s *c);
+
+#endif
@@ -0,0 +1,187 @@
+#include "sched.h"
+#include "io_utils.h"
+#include "pool.h"
+#include "stats.h"
+
+#include <pthread.h>
+#include <time.h>
+
+#include <sys/eventfd.h>
+
+// Largest quantum granted at once; a class is given its weight times
+// this much per round
+#define QUANTUM     65536
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond;
+
+static uint64_t link_rate = 0;
+// Bytes the link can take, negative when granted ahead of time
+static double link_tokens = 0;
+static int weights[SCHED_CLASSES];
+static uint64_t bulk_threshold;
+
+// Queues of flows waiting for a quantum, by class
+static sched_flow *heads[SCHED_CLASSES], **tails[SCHED_CLASSES];
+static int num_queued = 0;
+
+static const enum stats_counter grants_stat[SCHED_CLASSES] = {
+  STAT_SCHED_INTERACTIVE_GRANTS, STAT_SCHED_BULK_GRANTS,
+};
+static const enum stats_counter wait_stat[SCHED_CLASSES] = {
+  STAT_SCHED_INTERACTIVE_WAIT_US, STAT_SCHED_BULK_WAIT_US,
+};
+static const enum stats_counter wait_max_stat[SCHED_CLASSES] = {
+  STAT_SCHED_INTERACTIVE_WAIT_US_MAX, STAT_SCHED_BULK_WAIT_US_MAX,
+};
+
+// Must be called with `mutex` held
+static void grant(sched_flow *f, size_t n, uint64_t now)
+{
+  heads[f->cls] = f->next;
+  if (heads[f->cls] == NULL) tails[f->cls] = &heads[f->cls];
+  num_queued--;
+
+  f->granted += n;
+  f->queued = false;
+  f->next = NULL;
+  uint64_t wait = now - f->queued_at;
+  stats_add(grants_stat[f->cls], 1);
+  stats_add(wait_stat[f->cls], wait);
+  stats_max(wait_max_stat[f->cls], wait);
+  eventfd_write(f->wake_fd, 1);
+}
+
+static void *dispatch(void *arg)
+{
+  uint64_t last = monotonic_us();
+  int64_t deficit[SCHED_CLASSES] = { 0 };
+  int cur = 0;
+  bool turn = false;    // The current class has had its quantum added
+
+  pthread_mutex_lock(&mutex);
+  while (1) {
+    while (num_queued == 0) pthread_cond_wait(&cond, &mutex);
+
+    // Paced at the link rate, holding at most a quantum in reserve
+    uint64_t now = monotonic_us();
+    link_tokens += (double)link_rate * (now - last) / 1000000;
+    if (link_tokens > QUANTUM) link_tokens = QUANTUM;
+    last = now;
+    if (link_tokens < 0) {
+      // monotonic_us() reads the clock the condition waits on
+      uint64_t until = now + 1 +
+        (uint64_t)(-link_tokens * 1000000 / link_rate);
+      struct timespec ts = {
+        .tv_sec = until / 1000000,
+        .tv_nsec = until % 1000000 * 1000,
+      };
+      pthread_cond_timedwait(&cond, &mutex, &ts);
+      continue;
+    }
+
+    // Deficit round robin: a class keeps what is left of its deficit only
+    // while it has flows waiting
+    sched_flow *f = heads[cur];
+    if (f == NULL) {
+      deficit[cur] = 0;
+    } else {
+      if (!turn) {
+        deficit[cur] += (int64_t)weights[cur] * QUANTUM;
+        turn = true;
+      }
+      if ((int64_t)f->want <= deficit[cur]) {
+        deficit[cur] -= f->want;
+        link_tokens -= f->want;
+        grant(f, f->want, now);
+        continue;
+      }
+    }
+    cur = (cur + 1) % SCHED_CLASSES;
+    turn = false;
+  }
+
+  return NULL;
+}
+
+void sched_init(uint64_t rate, const int w[SCHED_CLASSES], uint64_t bulk_size)
+{
+  link_rate = rate;
+  for (int k = 0; k < SCHED_CLASSES; k++) {
+    weights[k] = (w[k] > 0 ? w[k] : 1);
+    heads[k] = NULL;
+    tails[k] = &heads[k];
+  }
+  bulk_threshold = bulk_size;
+  if (rate == 0) return;
+
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&cond, &attr);
+  pthread_condattr_destroy(&attr);
+  if (thread_spawn(&dispatch, NULL) != 0)
+    panic("pthread_create() failed");
+}
+
+sched_class sched_classify(int64_t left)
+{
+  return (left >= 0 && (uint64_t)left >= bulk_threshold ?
+    SCHED_BULK : SCHED_INTERACTIVE);
+}
+
+void sched_flow_init(sched_flow *f, sched_class cls, int wake_fd)
+{
+  f->cls = cls;
+  f->wake_fd = wake_fd;
+  f->granted = 0;
+  f->want = 0;
+  f->queued = false;
+  f->next = NULL;
+}
+
+size_t sched_take(sched_flow *f, size_t want)
+{
+  if (link_rate == 0) return want;
+
+  pthread_mutex_lock(&mutex);
+  size_t n = f->granted;
+  if (n == 0 && !f->queued) {
+    f->want = (want < QUANTUM ? want : QUANTUM);
+    f->queued = true;
+    f->queued_at = monotonic_us();
+    *tails[f->cls] = f;
+    tails[f->cls] = &f->next;
+    if (num_queued++ == 0) pthread_cond_signal(&cond);
+  }
+  pthread_mutex_unlock(&mutex);
+  return (n < want ? n : want);
+}
+
+void sched_charge(sched_flow *f, size_t n)
+{
+  if (link_rate == 0) return;
+
+  pthread_mutex_lock(&mutex);
+  f->granted = (n < f->granted ? f->granted - n : 0);
+  pthread_mutex_unlock(&mutex);
+}
+
+void sched_leave(sched_flow *f)
+{
+  if (link_rate == 0) return;
+
+  pthread_mutex_lock(&mutex);
+  if (f->queued) {
+    sched_flow **p = &heads[f->cls];
+    while (*p != f) p = &(*p)->next;
+    *p = f->next;
+    if (*p == NULL) tails[f->cls] = p;
+    num_queued--;
+    f->queued = false;
+  }
+  link_tokens += f->granted;
+  f->granted = 0;
+  f->next = NULL;
+  pthread_mutex_unlock(&mutex);
+}
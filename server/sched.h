@@ -0,0 +1,49 @@
+#ifndef zzftp__sched_h
+#define zzftp__sched_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Fair sharing of the outgoing link among downloads
+// A dispatcher thread hands out send quanta at the configured link rate,
+// taking turns between classes by deficit round robin, so that each
+// class with transfers waiting gets a share in proportion to its weight
+// and a class alone gets the whole link. Within a class, transfers are
+// served in turn
+
+typedef enum sched_class_e {
+  SCHED_INTERACTIVE,    // Listings and small files
+  SCHED_BULK,           // Files with much left to send
+  SCHED_CLASSES
+} sched_class;
+
+// A transfer taking part in the scheduling
+typedef struct sched_flow_s {
+  sched_class cls;
+  int wake_fd;          // Written to when a quantum is granted
+  // Guarded by the scheduler
+  size_t granted;       // Bytes granted and not yet sent
+  size_t want;          // Size of the quantum waited for
+  bool queued;
+  uint64_t queued_at;
+  struct sched_flow_s *next;
+} sched_flow;
+
+// Starts the dispatcher; a rate of 0 turns scheduling off
+void sched_init(uint64_t rate, const int weights[SCHED_CLASSES],
+  uint64_t bulk_size);
+
+// Class of a transfer with `left` bytes to send, -1 for a listing
+sched_class sched_classify(int64_t left);
+
+void sched_flow_init(sched_flow *f, sched_class cls, int wake_fd);
+// Returns how many of `want` bytes may be sent now; if none, the flow
+// waits for a quantum and its `wake_fd` is written to once granted
+size_t sched_take(sched_flow *f, size_t want);
+// Accounts for bytes sent from the flow's grant
+void sched_charge(sched_flow *f, size_t n);
+// Takes the flow out of the scheduling, returning what it did not use
+void sched_leave(sched_flow *f);
+
+#endif
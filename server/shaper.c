@@ -0,0 +1,199 @@
+#include "shaper.h"
+#include "io_utils.h"
+#include "stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// A bucket holds at most this long a time's worth of tokens, and no less
+// than BURST_MIN bytes, which also bounds the debt of a single grant
+#define BURST_DIV   10
+#define BURST_MIN   4096
+
+struct shaper_user_s {
+  char *name;
+  int refs;
+  shaper_bucket b[SHAPER_DIRS];
+  shaper_user *next;
+};
+
+static uint64_t rates[SHAPER_SCOPES][SHAPER_DIRS];
+static shaper_bucket global[SHAPER_DIRS] = {
+  { .mutex = PTHREAD_MUTEX_INITIALIZER },
+  { .mutex = PTHREAD_MUTEX_INITIALIZER },
+};
+
+// Users with sessions, usually few
+static pthread_mutex_t users_mutex = PTHREAD_MUTEX_INITIALIZER;
+static shaper_user *users = NULL;
+
+static inline double burst_of(uint64_t rate)
+{
+  double burst = (double)rate / BURST_DIV;
+  return (burst > BURST_MIN ? burst : BURST_MIN);
+}
+
+static void bucket_init(shaper_bucket *b)
+{
+  pthread_mutex_init(&b->mutex, NULL);
+  b->tokens = 0;
+  b->last_us = monotonic_us();
+}
+
+// Must be called with `b->mutex` held
+static inline void bucket_refill(shaper_bucket *b, uint64_t rate, uint64_t now)
+{
+  if (now > b->last_us) {
+    b->tokens += (double)rate * (now - b->last_us) / 1000000;
+    double burst = burst_of(rate);
+    if (b->tokens > burst) b->tokens = burst;
+  }
+  b->last_us = now;
+}
+
+void shaper_set_rate(shaper_scope scope, shaper_dir dir, uint64_t rate)
+{
+  __atomic_store_n(&rates[scope][dir], rate, __ATOMIC_RELAXED);
+}
+
+uint64_t shaper_get_rate(shaper_scope scope, shaper_dir dir)
+{
+  return __atomic_load_n(&rates[scope][dir], __ATOMIC_RELAXED);
+}
+
+void shaper_session_set_rate(shaper_session *s, shaper_dir dir,
+  uint64_t rate)
+{
+  __atomic_store_n(&s->own[dir], rate, __ATOMIC_RELAXED);
+}
+
+uint64_t shaper_session_rate(shaper_session *s, shaper_dir dir)
+{
+  uint64_t level = shaper_get_rate(SHAPER_SESSION, dir);
+  uint64_t own = __atomic_load_n(&s->own[dir], __ATOMIC_RELAXED);
+  return (own != 0 && (level == 0 || own < level) ? own : level);
+}
+
+void shaper_session_init(shaper_session *s)
+{
+  for (int d = 0; d < SHAPER_DIRS; d++) {
+    bucket_init(&s->b[d]);
+    s->own[d] = 0;
+  }
+  s->user = NULL;
+}
+
+void shaper_session_deinit(shaper_session *s)
+{
+  shaper_user *u = s->user;
+  if (u == NULL) return;
+  s->user = NULL;
+
+  pthread_mutex_lock(&users_mutex);
+  if (--u->refs == 0) {
+    shaper_user **p = &users;
+    while (*p != u) p = &(*p)->next;
+    *p = u->next;
+  } else {
+    u = NULL;
+  }
+  pthread_mutex_unlock(&users_mutex);
+
+  if (u != NULL) {
+    free(u->name);
+    free(u);
+  }
+}
+
+void shaper_session_login(shaper_session *s, const char *user)
+{
+  shaper_session_deinit(s);
+
+  pthread_mutex_lock(&users_mutex);
+  shaper_user *u = users;
+  while (u != NULL && strcmp(u->name, user) != 0) u = u->next;
+  if (u == NULL) {
+    u = malloc(sizeof(shaper_user));
+    u->name = strdup(user);
+    u->refs = 0;
+    for (int d = 0; d < SHAPER_DIRS; d++) bucket_init(&u->b[d]);
+    u->next = users;
+    users = u;
+  }
+  u->refs++;
+  pthread_mutex_unlock(&users_mutex);
+
+  s->user = u;
+}
+
+// Buckets a session's data goes through, NULL for those not set up
+static inline void buckets_of(shaper_session *s, shaper_dir dir,
+  shaper_bucket *bs[SHAPER_SCOPES])
+{
+  bs[SHAPER_GLOBAL] = &global[dir];
+  bs[SHAPER_USER] = (s->user != NULL ? &s->user->b[dir] : NULL);
+  bs[SHAPER_SESSION] = &s->b[dir];
+}
+
+static inline uint64_t rate_of(shaper_session *s, shaper_scope scope,
+  shaper_dir dir)
+{
+  return (scope == SHAPER_SESSION ?
+    shaper_session_rate(s, dir) : shaper_get_rate(scope, dir));
+}
+
+size_t shaper_grant(shaper_session *s, shaper_dir dir, size_t want,
+  uint64_t *wait_us)
+{
+  shaper_bucket *bs[SHAPER_SCOPES];
+  buckets_of(s, dir, bs);
+  uint64_t now = 0;
+  uint64_t wait = 0;
+  int by = 0;
+
+  for (int k = 0; k < SHAPER_SCOPES; k++) {
+    uint64_t rate = rate_of(s, k, dir);
+    if (rate == 0 || bs[k] == NULL) continue;
+    if (now == 0) now = monotonic_us();
+
+    pthread_mutex_lock(&bs[k]->mutex);
+    bucket_refill(bs[k], rate, now);
+    double tokens = bs[k]->tokens;
+    pthread_mutex_unlock(&bs[k]->mutex);
+
+    if (tokens < 0) {
+      uint64_t w = (uint64_t)(-tokens * 1000000 / rate) + 1;
+      if (w > wait) {
+        wait = w;
+        by = k;
+      }
+    } else if (want > burst_of(rate)) {
+      want = burst_of(rate);
+    }
+  }
+
+  if (wait > 0) {
+    stats_add(STAT_THROTTLE_GLOBAL + by, 1);
+    *wait_us = wait;
+    return 0;
+  }
+  return want;
+}
+
+void shaper_charge(shaper_session *s, shaper_dir dir, size_t n)
+{
+  shaper_bucket *bs[SHAPER_SCOPES];
+  buckets_of(s, dir, bs);
+  uint64_t now = 0;
+
+  for (int k = 0; k < SHAPER_SCOPES; k++) {
+    uint64_t rate = rate_of(s, k, dir);
+    if (rate == 0 || bs[k] == NULL) continue;
+    if (now == 0) now = monotonic_us();
+
+    pthread_mutex_lock(&bs[k]->mutex);
+    bucket_refill(bs[k], rate, now);
+    bs[k]->tokens -= n;
+    pthread_mutex_unlock(&bs[k]->mutex);
+  }
+}
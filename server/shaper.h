@@ -0,0 +1,66 @@
+#ifndef zzftp__shaper_h
+#define zzftp__shaper_h
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Bandwidth limits on data connections, as token buckets at three levels:
+// the whole server, each user and each session, apart for downloads and
+// uploads. Bytes moved are charged to every bucket on their way; data
+// moves only while none of them is in debt, and otherwise waits for the
+// one deepest in debt to be paid back
+
+typedef enum shaper_dir_e {
+  SHAPER_DOWN,      // Sent by the server: RETR and listings
+  SHAPER_UP,        // Received: STOR
+  SHAPER_DIRS
+} shaper_dir;
+
+typedef enum shaper_scope_e {
+  SHAPER_GLOBAL,
+  SHAPER_USER,
+  SHAPER_SESSION,
+  SHAPER_SCOPES
+} shaper_scope;
+
+typedef struct shaper_bucket_s {
+  pthread_mutex_t mutex;
+  double tokens;      // Bytes that may be moved, negative when in debt
+  uint64_t last_us;   // Time of the last refill
+} shaper_bucket;
+
+typedef struct shaper_user_s shaper_user;
+
+// Buckets of a session, and those shared by the sessions of its user
+typedef struct shaper_session_s {
+  shaper_bucket b[SHAPER_DIRS];
+  uint64_t own[SHAPER_DIRS];  // Limits set by the session itself, 0 for none
+  shaper_user *user;  // NULL until logged in
+} shaper_session;
+
+// Sets the limit of each bucket of a level, in bytes per second, or 0 for
+// none; transfers under way follow the new limit at once
+void shaper_set_rate(shaper_scope scope, shaper_dir dir, uint64_t rate);
+uint64_t shaper_get_rate(shaper_scope scope, shaper_dir dir);
+
+// Sets a session's own limit, which applies below that of the level; the
+// session is held to the lower of the two
+void shaper_session_set_rate(shaper_session *s, shaper_dir dir,
+  uint64_t rate);
+// Limit the session is held to, 0 for none
+uint64_t shaper_session_rate(shaper_session *s, shaper_dir dir);
+
+void shaper_session_init(shaper_session *s);
+void shaper_session_deinit(shaper_session *s);
+// Charges the session to the buckets of a user from now on
+void shaper_session_login(shaper_session *s, const char *user);
+
+// Returns how many of `want` bytes may be moved now, or 0 while a bucket is
+// in debt, with `*wait_us` set to the time until it is paid back
+size_t shaper_grant(shaper_session *s, shaper_dir dir, size_t want,
+  uint64_t *wait_us);
+// Charges bytes that have been moved
+void shaper_charge(shaper_session *s, shaper_dir dir, size_t n);
+
+#endif
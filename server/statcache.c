@@ -0,0 +1,125 @@
+#include "statcache.h"
+#include "io_utils.h"
+#include "path_utils.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Slots are direct-mapped by path hash, so a lookup touches one slot and
+// an insertion simply replaces its previous occupant
+// Each lock guards every NUM_LOCKS-th slot
+#define NUM_LOCKS 64
+
+typedef struct slot_s {
+  char *path;       // NULL if empty
+  int err;          // errno of a failed lstat(), or 0
+  struct stat st;
+  uint64_t expires; // Monotonic time in milliseconds
+  unsigned gen;     // Incremented on every invalidation of the slot
+} slot;
+
+static pthread_mutex_t locks[NUM_LOCKS];
+static slot *slots = NULL;
+static size_t num_slots = 0;
+static int ttl;
+
+static size_t hash(const char *path)
+{
+  return path_hash(path) % num_slots;
+}
+
+static void clear(slot *s)
+{
+  free(s->path);
+  s->path = NULL;
+  s->gen++;
+}
+
+void statcache_init(size_t n, int ttl_ms)
+{
+  if (n == 0 || ttl_ms <= 0) return;
+
+  for (int i = 0; i < NUM_LOCKS; i++) pthread_mutex_init(&locks[i], NULL);
+  slots = calloc(n, sizeof(slot));
+  num_slots = n;
+  ttl = ttl_ms;
+}
+
+int statcache_lstat(const char *path, struct stat *st)
+{
+  const char *rel = (path[1] == '\0' ? "." : path + 1);
+  if (slots == NULL) return path_lstat(path_root_fd, rel, st);
+
+  size_t i = hash(path);
+  slot *s = &slots[i];
+  pthread_mutex_t *lock = &locks[i % NUM_LOCKS];
+
+  pthread_mutex_lock(lock);
+  if (s->path != NULL && strcmp(s->path, path) == 0 &&
+      s->expires > monotonic_ms()) {
+    int err = s->err;
+    if (err == 0) *st = s->st;
+    pthread_mutex_unlock(lock);
+    if (err == 0) return 0;
+    errno = err;
+    return -1;
+  }
+  unsigned gen = s->gen;
+  pthread_mutex_unlock(lock);
+
+  // Not held during the system call; the result is discarded if the slot
+  // has been invalidated in the meantime, as it may predate the change
+  uint64_t t = monotonic_ms();
+  int ret = path_lstat(path_root_fd, rel, st);
+  int err = (ret == 0 ? 0 : errno);
+
+  pthread_mutex_lock(lock);
+  if (s->gen == gen) {
+    if (s->path == NULL || strcmp(s->path, path) != 0) {
+      free(s->path);
+      s->path = strdup(path);
+    }
+    s->err = err;
+    if (err == 0) s->st = *st;
+    s->expires = t + ttl;
+  }
+  pthread_mutex_unlock(lock);
+
+  errno = err;
+  return ret;
+}
+
+void statcache_invalidate(const char *path)
+{
+  if (slots == NULL) return;
+
+  size_t i = hash(path);
+  pthread_mutex_lock(&locks[i % NUM_LOCKS]);
+  // Cleared even if occupied by another path, to discard a result
+  // of this path being stored concurrently
+  clear(&slots[i]);
+  pthread_mutex_unlock(&locks[i % NUM_LOCKS]);
+}
+
+void statcache_invalidate_tree(const char *path)
+{
+  if (slots == NULL) return;
+
+  size_t len = strlen(path);
+  for (int l = 0; l < NUM_LOCKS; l++) {
+    pthread_mutex_lock(&locks[l]);
+    for (size_t i = l; i < num_slots; i += NUM_LOCKS) {
+      const char *p = slots[i].path;
+      if (p != NULL && strncmp(p, path, len) == 0 &&
+          (p[len] == '\0' || p[len] == '/' || len == 1))
+        clear(&slots[i]);
+      else
+        slots[i].gen++;   // See statcache_invalidate()
+    }
+    pthread_mutex_unlock(&locks[l]);
+  }
+}
@@ -0,0 +1,24 @@
+#ifndef zzftp__statcache_h
+#define zzftp__statcache_h
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+// A cache of lstat() results shared by all sessions
+// Entries expire after a short time, and are dropped earlier when the
+// server itself changes the path; changes made outside the server are
+// noticed once the entry expires
+// Paths are given relative to the FTP root, starting with a slash
+
+// Enables the cache with the given number of slots and lifetime
+// (0 slots leaves it disabled)
+void statcache_init(size_t num_slots, int ttl_ms);
+
+// Same as path_lstat() from the root, possibly from the cache
+int statcache_lstat(const char *path, struct stat *st);
+// Drops the entry of a path
+void statcache_invalidate(const char *path);
+// Drops the entries of a path and everything below it
+void statcache_invalidate_tree(const char *path);
+
+#endif
@@ -0,0 +1,41 @@
+#include "stats.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+static uint64_t counters[STAT_COUNT];
+
+static const char *descs[STAT_COUNT] = {
+#define X(_id, _desc) _desc,
+  STATS_COUNTERS(X)
+#undef X
+};
+
+void stats_add(enum stats_counter k, uint64_t n)
+{
+  __atomic_fetch_add(&counters[k], n, __ATOMIC_RELAXED);
+}
+
+uint64_t stats_get(enum stats_counter k)
+{
+  return __atomic_load_n(&counters[k], __ATOMIC_RELAXED);
+}
+
+void stats_max(enum stats_counter k, uint64_t n)
+{
+  uint64_t cur = stats_get(k);
+  while (cur < n && !__atomic_compare_exchange_n(&counters[k], &cur, n,
+      true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) { }
+}
+
+size_t stats_format(char *buf, size_t size)
+{
+  if (size == 0) return 0;
+  size_t len = 0;
+  buf[0] = '\0';
+  for (int k = 0; k < STAT_COUNT && len < size; k++)
+    len += snprintf(buf + len, size - len, "%s: %" PRIu64 "\n",
+      descs[k], stats_get(k));
+  return (len < size ? len : size - 1);
+}
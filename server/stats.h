@@ -0,0 +1,48 @@
+#ifndef zzftp__stats_h
+#define zzftp__stats_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Server-wide counters, reported by the STAT command
+#define STATS_COUNTERS(X) \
+  X(SEND_SENDFILE_BYTES, "Bytes sent with sendfile()") \
+  X(SEND_COPY_BYTES,     "Bytes sent through buffer copies") \
+  X(RECV_SPLICE_BYTES,   "Bytes received with splice()") \
+  X(RECV_COPY_BYTES,     "Bytes received through buffer copies") \
+  X(DEFLATE_IN_BYTES,    "Bytes compressed in MODE Z") \
+  X(DEFLATE_OUT_BYTES,   "Bytes produced by MODE Z compression") \
+  X(DEFLATE_SKIPS,       "Incompressible files sent at MODE Z level 0") \
+  X(THROTTLE_GLOBAL,     "Waits for the global rate limit") \
+  X(THROTTLE_USER,       "Waits for a per-user rate limit") \
+  X(THROTTLE_SESSION,    "Waits for a per-session rate limit") \
+  X(THROTTLE_DOWN_US,    "Time downloads waited for rate limits (us)") \
+  X(THROTTLE_UP_US,      "Time uploads waited for rate limits (us)") \
+  X(SCHED_INTERACTIVE_GRANTS,     "Quanta granted to interactive downloads") \
+  X(SCHED_INTERACTIVE_WAIT_US,    "Total queueing delay of interactive downloads (us)") \
+  X(SCHED_INTERACTIVE_WAIT_US_MAX, "Maximum queueing delay of interactive downloads (us)") \
+  X(SCHED_BULK_GRANTS,            "Quanta granted to bulk downloads") \
+  X(SCHED_BULK_WAIT_US,           "Total queueing delay of bulk downloads (us)") \
+  X(SCHED_BULK_WAIT_US_MAX,       "Maximum queueing delay of bulk downloads (us)") \
+  X(PASV_ACCEPTS,        "Passive connections accepted") \
+  X(PASV_ACCEPT_US,      "Total PASV-to-accept latency (us)") \
+  X(PASV_ACCEPT_US_MAX,  "Maximum PASV-to-accept latency (us)")
+
+enum stats_counter {
+#define X(_id, _desc) STAT_##_id,
+  STATS_COUNTERS(X)
+#undef X
+  STAT_COUNT
+};
+
+// Updates and reads counters atomically
+void stats_add(enum stats_counter k, uint64_t n);
+uint64_t stats_get(enum stats_counter k);
+// Raises a counter to `n` if it is below that
+void stats_max(enum stats_counter k, uint64_t n);
+
+// Writes all counters to `buf`, one per line
+// Returns the length of the string written (truncated if longer than `size`)
+size_t stats_format(char *buf, size_t size);
+
+#endif